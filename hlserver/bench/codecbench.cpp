@@ -0,0 +1,275 @@
+// Microbenchmarks for the transaction codec and the string and date helpers every request
+// goes through. Prints one JSON document so runs can be diffed or fed to a script.
+
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <getopt.h>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "globals.hpp"
+#include "transactions.hpp"
+#include "users.hpp"
+
+using std::chrono::steady_clock;
+
+// Keeps the compiler from proving a result unused and throwing the work away
+template <class T>
+static inline void Keep(const T &v)
+{
+	asm volatile("" : : "r,m"(v) : "memory");
+}
+
+struct Benchmark final
+{
+	std::string name;
+	size_t bytes; // processed per iteration, 0 if that doesn't mean anything
+	std::function<void(size_t)> run; // does the given number of iterations
+};
+
+struct Result final
+{
+	std::string name;
+	size_t bytes, iterations;
+	double min_ns, median_ns, max_ns; // per iteration, over the samples
+};
+
+static std::string Text(size_t len, char newline)
+{
+	std::string s;
+	for (size_t i = 0; i < len; i++) s += (i % 64 == 63) ? newline : static_cast<char>('a'+i % 26);
+	return s;
+}
+
+static Result Measure(const Benchmark &b, double sample_secs, unsigned samples)
+{
+	// grow the batch until one takes long enough for the clock not to matter
+	size_t iterations = 1;
+	for (;;)
+	{
+		auto start = steady_clock::now();
+		b.run(iterations);
+		double secs = std::chrono::duration<double>(steady_clock::now()-start).count();
+		if (secs >= sample_secs/4 || iterations >= (size_t(1) << 40)) break;
+		iterations *= secs > 0 ? std::min(10.0, std::max(2.0, sample_secs/4/secs)) : 10;
+	}
+	iterations = std::max<size_t>(1, iterations*4);
+	
+	std::vector<double> ns;
+	for (unsigned i = 0; i < samples; i++)
+	{
+		auto start = steady_clock::now();
+		b.run(iterations);
+		ns.push_back(std::chrono::duration<double, std::nano>(steady_clock::now()-start).count()/iterations);
+	}
+	std::sort(ns.begin(), ns.end());
+	
+	return Result { b.name, b.bytes, iterations, ns.front(), ns[ns.size()/2], ns.back() };
+}
+
+static std::vector<Benchmark> Benchmarks(User &user)
+{
+	std::vector<Benchmark> v;
+	
+	// a chat line, a login and a 100 user list are what the server sees most
+	static const std::string chat = Text(120, '\n'), longtext = Text(4096, '\n'), crtext = Text(4096, '\r');
+	static const std::string password = ConvertString("correct horse battery");
+	
+	Transaction login(nullptr, OP_LOGIN, false, 1);
+	login.AddString(F_USERLOGIN, ConvertString("someone"));
+	login.AddString(F_USERPASSWORD, password);
+	login.AddInt16(F_VERS, 190);
+	
+	Transaction list(&user, 0, true, 1);
+	for (int i = 0; i < 100; i++)
+	{
+		user.id = i+1;
+		user.name = "user number "+std::to_string(i);
+		list.AddUserInfo(&user);
+	}
+	
+	static std::vector<uint8_t> login_frame, list_frame;
+	login.Write(login_frame, true);
+	list.Write(list_frame, true);
+	
+	auto encode = [](const Transaction &proto, size_t n)
+	{
+		std::vector<uint8_t> out;
+		for (size_t i = 0; i < n; i++)
+		{
+			out.clear();
+			Transaction t(proto);
+			t.Write(out, true);
+			Keep(out.data());
+		}
+	};
+	
+	v.push_back({ "Transaction::Write/login", login_frame.size(), [login, encode](size_t n) { encode(login, n); } });
+	v.push_back({ "Transaction::Write/userlist100", list_frame.size(), [list, encode](size_t n) { encode(list, n); } });
+	
+	auto decode = [&user](const std::vector<uint8_t> &frame, size_t n)
+	{
+		for (size_t i = 0; i < n; i++)
+		{
+			Transaction *t = new Transaction(&user, frame.data());
+			bool ok = t->ReadParams(frame.data()+TRANSACTION_HEADER_SIZE, frame.size()-TRANSACTION_HEADER_SIZE);
+			Keep(ok);
+			delete t;
+		}
+	};
+	
+	v.push_back({ "Transaction::ReadParams/login", login_frame.size(), [decode](size_t n) { decode(login_frame, n); } });
+	v.push_back({ "Transaction::ReadParams/userlist100", list_frame.size(), [decode](size_t n) { decode(list_frame, n); } });
+	
+	// one field at a time, the way the handlers build replies
+	auto add = [](std::function<void(Transaction&)> f, size_t n)
+	{
+		Transaction t(nullptr, 0, true, 0);
+		for (size_t i = 0; i < n; i++)
+		{
+			if (!(i % 64))
+			{
+				t.params.clear();
+				t.storage.clear();
+			}
+			f(t);
+			Keep(t.storage.data());
+		}
+	};
+	
+	v.push_back({ "Transaction::AddInt16", 2, [add](size_t n) { add([](Transaction &t) { t.AddInt16(F_USERID, 1); }, n); } });
+	v.push_back({ "Transaction::AddInt32", 4, [add](size_t n) { add([](Transaction &t) { t.AddInt32(F_REFNUM, 1); }, n); } });
+	v.push_back({ "Transaction::AddInt64", 8, [add](size_t n) { add([](Transaction &t) { t.AddInt64(F_USERACCESS, 1); }, n); } });
+	v.push_back({ "Transaction::AddString/120", chat.size(),
+		[add](size_t n) { add([](Transaction &t) { t.AddString(F_DATA, chat); }, n); } });
+	v.push_back({ "Transaction::AddBytes/120", chat.size(),
+		[add](size_t n)
+		{
+			add([](Transaction &t) { t.AddBytes(F_DATA, reinterpret_cast<const uint8_t*>(chat.data()), chat.size()); }, n);
+		} });
+	
+	auto now = std::chrono::system_clock::now();
+	v.push_back({ "Transaction::AddTime", 8, [add, now](size_t n) { add([now](Transaction &t) { t.AddTime(F_FILECREATEDATE, now); }, n); } });
+	v.push_back({ "Transaction::AddUserInfo", UserInfoSize(&user),
+		[add, &user](size_t n) { add([&user](Transaction &t) { t.AddUserInfo(&user); }, n); } });
+	
+	// and reading them back
+	auto view = [](const Transaction &t, std::function<void(const ParamView&)> f, size_t n)
+	{
+		ParamView p = t[0];
+		for (size_t i = 0; i < n; i++) f(p);
+	};
+	
+	Transaction fields(nullptr, 0, false, 0);
+	fields.AddInt32(F_REFNUM, 12345);
+	Transaction text(nullptr, 0, false, 0);
+	text.AddString(F_DATA, chat);
+	Transaction date(nullptr, 0, false, 0);
+	date.AddTime(F_FILECREATEDATE, now);
+	
+	v.push_back({ "ParamView::AsInt32", 4, [fields, view](size_t n) { view(fields, [](const ParamView &p) { Keep(p.AsInt32()); }, n); } });
+	v.push_back({ "ParamView::AsString", chat.size(), [text, view](size_t n) { view(text, [](const ParamView &p) { Keep(p.AsString()); }, n); } });
+	v.push_back({ "ParamView::AsTime", 8, [date, view](size_t n) { view(date, [](const ParamView &p) { Keep(p.AsTime()); }, n); } });
+	v.push_back({ "Transaction::Find/userlist100", 0,
+		[list](size_t n) { for (size_t i = 0; i < n; i++) Keep(list.Find(F_ERRORTEXT).has_value()); } });
+	
+	v.push_back({ "DateTime::FromTimePoint", 0,
+		[now](size_t n)
+		{
+			DateTime d(now);
+			for (size_t i = 0; i < n; i++)
+			{
+				d.FromTimePoint(now+std::chrono::seconds(i & 1023));
+				Keep(d);
+			}
+		} });
+	v.push_back({ "DateTime::TimePoint", 0,
+		[now](size_t n)
+		{
+			DateTime d(now);
+			for (size_t i = 0; i < n; i++) Keep(d.TimePoint());
+		} });
+	
+	v.push_back({ "ConvertString/22", password.size(), [](size_t n) { for (size_t i = 0; i < n; i++) Keep(ConvertString(password)); } });
+	v.push_back({ "LF2CR/120", chat.size(), [](size_t n) { for (size_t i = 0; i < n; i++) Keep(LF2CR(chat)); } });
+	v.push_back({ "LF2CR/4096", longtext.size(), [](size_t n) { for (size_t i = 0; i < n; i++) Keep(LF2CR(longtext)); } });
+	v.push_back({ "CR2LF/4096", crtext.size(), [](size_t n) { for (size_t i = 0; i < n; i++) Keep(CR2LF(crtext)); } });
+	
+	return v;
+}
+
+static void Usage(const char *self)
+{
+	std::cerr << "Usage: " << self << " [options]\n"
+		"  -f, --filter <s>            only run benchmarks whose name contains s\n"
+		"  -s, --samples <n>           samples per benchmark (default 7)\n"
+		"  -m, --sample-ms <n>         target length of a sample (default 100)\n"
+		"  -l, --list                  list the benchmarks and exit\n";
+}
+
+int main(int argc, char **argv)
+{
+	static const option opts[] =
+	{
+		{ "filter", required_argument, nullptr, 'f' },
+		{ "samples", required_argument, nullptr, 's' },
+		{ "sample-ms", required_argument, nullptr, 'm' },
+		{ "list", no_argument, nullptr, 'l' },
+		{ "help", no_argument, nullptr, 'h' },
+		{ nullptr, 0, nullptr, 0 }
+	};
+	
+	std::string filter;
+	unsigned samples = 7, sample_ms = 100;
+	bool list = false;
+	
+	int c;
+	while ((c = getopt_long(argc, argv, "f:s:m:lh", opts, nullptr)) != -1)
+	{
+		switch (c)
+		{
+			case 'f': filter = optarg; break;
+			case 's': samples = std::max(1ul, std::strtoul(optarg, nullptr, 10)); break;
+			case 'm': sample_ms = std::max(1ul, std::strtoul(optarg, nullptr, 10)); break;
+			case 'l': list = true; break;
+			default:
+				Usage(argv[0]);
+				return 1;
+		}
+	}
+	
+	boost::asio::io_service io;
+	User user(io);
+	user.name = "benchmark user";
+	
+	auto benchmarks = Benchmarks(user);
+	if (list)
+	{
+		for (auto &b: benchmarks) std::cout << b.name << '\n';
+		return 0;
+	}
+	
+	printf("{\n  \"samples\": %u,\n  \"sample_ms\": %u,\n  \"benchmarks\": [", samples, sample_ms);
+	
+	bool first = true;
+	for (auto &b: benchmarks)
+	{
+		if (b.name.find(filter) == std::string::npos) continue;
+		
+		Result r = Measure(b, sample_ms/1000.0, samples);
+		printf("%s\n    { \"name\": \"%s\", \"iterations\": %zu, \"bytes\": %zu, \"ns_min\": %.2f, \"ns_median\": %.2f, "
+			"\"ns_max\": %.2f, \"mb_per_sec\": %.1f }", first ? "" : ",", r.name.c_str(), r.iterations, r.bytes,
+			r.min_ns, r.median_ns, r.max_ns, r.bytes ? r.bytes/r.median_ns*1e3 : 0.0);
+		fflush(stdout);
+		first = false;
+	}
+	
+	printf("\n  ]\n}\n");
+	return 0;
+}
@@ -0,0 +1,475 @@
+// Drives a local hlserver with lots of simulated clients: each one greets, logs in, agrees,
+// fetches the user list and then keeps sending a mix of chat and keepalives.
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/endian/conversion.hpp>
+#include <boost/thread.hpp>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <getopt.h>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "transactions.hpp"
+
+using boost::asio::ip::tcp;
+using std::chrono::steady_clock;
+
+enum Stage
+{
+	ST_HELLO = 0,
+	ST_LOGIN,
+	ST_AGREED,
+	ST_USERLIST,
+	ST_CHAT,
+	ST_COUNT
+};
+
+static const char *STAGE_NAMES[] = { "handshake", "OP_LOGIN", "OP_AGREED", "OP_GETUSERNAMELIST", "OP_CHATSEND" };
+
+struct BenchConfig final
+{
+	std::string host = "127.0.0.1";
+	uint16_t port = 5500;
+	unsigned clients = 1000;
+	unsigned threads = 0; // 0 for one per core
+	unsigned duration = 10; // seconds of steady traffic to measure
+	unsigned ready_timeout = 60; // seconds to wait for every client to log in
+	double rate = 1.0; // requests per client per second once logged in
+	double chat = 0.5; // share of those requests that are chat, the rest are keepalives
+	long pid = 0; // server to take RSS readings from
+};
+
+// One per thread, so the clients on it can record without locking
+struct Stats final
+{
+	std::array<std::vector<uint32_t>, ST_COUNT> latency_us;
+	uint64_t sent = 0, keepalives = 0, chats = 0, errors = 0, bytes_in = 0, bytes_out = 0;
+};
+
+static std::atomic<unsigned> ready(0);
+static std::atomic<bool> measuring(false), stopping(false);
+
+class Client final
+{
+public:
+	Client(boost::asio::io_service &io, const BenchConfig &config, Stats &stats, unsigned n):
+		config(config),
+		stats(stats),
+		sock(io),
+		timer(io),
+		rx(16*1024),
+		rx_end(0),
+		stage(ST_HELLO),
+		next_id(1),
+		chat_seq(0),
+		n(n),
+		rng(n)
+	{
+	}
+	
+	void Start(const tcp::endpoint &ep)
+	{
+		sock.async_connect(ep,
+			[this](boost::system::error_code ec)
+			{
+				if (ec) return Fail(ec);
+				
+				static const uint8_t hello[12] = { 'T', 'R', 'T', 'P', 'H', 'O', 'T', 'L', 0, 1, 0, 2 };
+				sent_at[0] = Pending { ST_HELLO, steady_clock::now() };
+				Write(std::vector<uint8_t>(hello, hello+sizeof(hello)));
+				Read();
+			});
+	}
+	
+	void Stop()
+	{
+		boost::system::error_code ec;
+		timer.cancel(ec);
+		sock.close(ec);
+	}
+private:
+	struct Pending
+	{
+		Stage stage;
+		steady_clock::time_point when;
+	};
+	
+	const BenchConfig &config;
+	Stats &stats;
+	tcp::socket sock;
+	boost::asio::steady_timer timer;
+	std::vector<uint8_t> rx;
+	size_t rx_end;
+	std::deque<std::vector<uint8_t>> tx;
+	std::map<uint32_t, Pending> sent_at; // by transaction ID, or chat sequence for chat
+	Stage stage;
+	uint32_t next_id, chat_seq;
+	unsigned n;
+	std::minstd_rand rng;
+	
+	void Fail(const boost::system::error_code &ec)
+	{
+		if (stopping) return;
+		if (!stats.errors++) std::cerr << "client " << n << ": " << ec.message() << '\n';
+		Stop();
+	}
+	
+	void Record(Stage s, steady_clock::time_point since)
+	{
+		auto us = std::chrono::duration_cast<std::chrono::microseconds>(steady_clock::now()-since).count();
+		stats.latency_us[s].push_back(static_cast<uint32_t>(std::min<int64_t>(us, UINT32_MAX)));
+	}
+	
+	void Write(std::vector<uint8_t> frame)
+	{
+		tx.push_back(std::move(frame));
+		if (tx.size() == 1) Flush();
+	}
+	
+	void Flush()
+	{
+		boost::asio::async_write(sock, boost::asio::buffer(tx.front()),
+			[this](boost::system::error_code ec, size_t s)
+			{
+				if (ec) return Fail(ec);
+				
+				stats.bytes_out += s;
+				tx.pop_front();
+				if (!tx.empty()) Flush();
+			});
+	}
+	
+	void Request(Transaction &trans, Stage s)
+	{
+		std::vector<uint8_t> frame;
+		trans.id = next_id++;
+		trans.Write(frame, true);
+		
+		if (s != ST_COUNT) sent_at[trans.id] = Pending { s, steady_clock::now() };
+		if (measuring) ++stats.sent;
+		Write(std::move(frame));
+	}
+	
+	void Read()
+	{
+		if (rx_end == rx.size()) rx.resize(rx.size()*2);
+		
+		sock.async_read_some(boost::asio::buffer(rx.data()+rx_end, rx.size()-rx_end),
+			[this](boost::system::error_code ec, size_t s)
+			{
+				if (ec) return Fail(ec);
+				
+				stats.bytes_in += s;
+				rx_end += s;
+				
+				size_t at = Parse();
+				std::memmove(rx.data(), rx.data()+at, rx_end-at);
+				rx_end -= at;
+				
+				Read();
+			});
+	}
+	
+	size_t Parse()
+	{
+		size_t at = 0;
+		
+		if (stage == ST_HELLO)
+		{
+			if (rx_end < 8) return 0;
+			if (std::memcmp(rx.data(), "TRTP", 4) != 0)
+			{
+				Fail(boost::asio::error::invalid_argument);
+				return rx_end;
+			}
+			
+			Record(ST_HELLO, sent_at[0].when);
+			sent_at.erase(0);
+			stage = ST_LOGIN;
+			at = 8;
+			
+			Transaction login(nullptr, OP_LOGIN, false, 0);
+			login.AddInt16(F_VERS, 190);
+			Request(login, ST_LOGIN);
+		}
+		
+		while (rx_end-at >= TRANSACTION_HEADER_SIZE)
+		{
+			const uint8_t *h = rx.data()+at;
+			uint32_t size = boost::endian::load_big_u32(h+12);
+			if (rx_end-at < TRANSACTION_HEADER_SIZE+size) break;
+			
+			OnTransaction(h, h+TRANSACTION_HEADER_SIZE, size);
+			at += TRANSACTION_HEADER_SIZE+size;
+		}
+		
+		return at;
+	}
+	
+	void OnTransaction(const uint8_t *h, const uint8_t *body, uint32_t size)
+	{
+		bool reply = h[1];
+		uint16_t type = boost::endian::load_big_u16(h+2);
+		uint32_t id = boost::endian::load_big_u32(h+4);
+		
+		if (reply)
+		{
+			auto it = sent_at.find(id);
+			if (it == sent_at.end()) return;
+			
+			Stage s = it->second.stage;
+			Record(s, it->second.when);
+			sent_at.erase(it);
+			
+			if (s == ST_LOGIN)
+			{
+				Transaction agreed(nullptr, OP_AGREED, false, 0);
+				agreed.AddString(F_USERNAME, "hlbench"+std::to_string(n));
+				agreed.AddInt16(F_USERICONID, 128);
+				Request(agreed, ST_AGREED);
+				
+				Transaction list(nullptr, OP_GETUSERNAMELIST, false, 0);
+				Request(list, ST_USERLIST);
+			}
+			else if (s == ST_USERLIST)
+			{
+				stage = ST_CHAT;
+				++ready;
+				Schedule();
+			}
+		}
+		else if (type == OP_CHATMSG)
+		{
+			// everybody's chat comes to everybody, ours ends in "#<client>/<seq>"
+			Transaction chat(nullptr, 0, false, 0);
+			if (!chat.ReadParams(body, size)) return;
+			
+			auto text = chat.Find(F_DATA);
+			if (!text) return;
+			
+			std::string_view s = text->AsString();
+			size_t hash = s.rfind('#');
+			if (hash == std::string_view::npos) return;
+			
+			unsigned who = 0, seq = 0;
+			if (std::sscanf(std::string(s.substr(hash+1)).c_str(), "%u/%u", &who, &seq) != 2 || who != n) return;
+			
+			auto it = sent_at.find(seq | 0x80000000);
+			if (it == sent_at.end()) return;
+			
+			Record(ST_CHAT, it->second.when);
+			if (measuring) ++stats.chats;
+			sent_at.erase(it);
+		}
+	}
+	
+	void Schedule()
+	{
+		// exponential gaps so the clients don't fall into step with each other
+		std::exponential_distribution<double> gap(config.rate);
+		timer.expires_after(std::chrono::microseconds(static_cast<int64_t>(gap(rng)*1e6)));
+		timer.async_wait(
+			[this](boost::system::error_code ec)
+			{
+				if (ec || stopping) return;
+				
+				if (std::uniform_real_distribution<double>(0, 1)(rng) < config.chat)
+				{
+					uint32_t seq = ++chat_seq & 0x7fffffff;
+					Transaction chat(nullptr, OP_CHATSEND, false, 0);
+					chat.AddString(F_DATA, "hlbench #"+std::to_string(n)+"/"+std::to_string(seq));
+					
+					// chat has no reply, so the clock stops when it comes back round as OP_CHATMSG
+					sent_at[seq | 0x80000000] = Pending { ST_CHAT, steady_clock::now() };
+					Request(chat, ST_COUNT);
+				}
+				else
+				{
+					Transaction keepalive(nullptr, OP_SENDKEEPALIVE, false, 0);
+					Request(keepalive, ST_COUNT);
+					if (measuring) ++stats.keepalives;
+				}
+				
+				Schedule();
+			});
+	}
+};
+
+static long ServerRSS(long pid)
+{
+	if (!pid) return -1;
+	
+	std::ifstream f("/proc/"+std::to_string(pid)+"/status");
+	std::string line;
+	while (std::getline(f, line))
+		if (line.compare(0, 6, "VmRSS:") == 0) return std::strtol(line.c_str()+6, nullptr, 10)*1024;
+	
+	return -1;
+}
+
+static void Usage(const char *self)
+{
+	std::cerr << "Usage: " << self << " [options]\n"
+		"  -H, --host <addr>           server address (default 127.0.0.1)\n"
+		"  -p, --port <n>              server port (default 5500)\n"
+		"  -c, --clients <n>           clients to simulate (default 1000)\n"
+		"  -t, --threads <n>           threads to run them on (default one per core)\n"
+		"  -d, --duration <n>          seconds of traffic to measure (default 10)\n"
+		"  -r, --rate <n>              requests per client per second (default 1)\n"
+		"      --chat <f>              share of requests that are chat (default 0.5)\n"
+		"      --ready-timeout <n>     seconds to wait for the clients to log in (default 60)\n"
+		"      --pid <n>               server process to read RSS from\n";
+}
+
+static bool ParseArgs(int argc, char **argv, BenchConfig &config)
+{
+	enum { OPT_CHAT = 256, OPT_READY_TIMEOUT, OPT_PID };
+	
+	static const option opts[] =
+	{
+		{ "host", required_argument, nullptr, 'H' },
+		{ "port", required_argument, nullptr, 'p' },
+		{ "clients", required_argument, nullptr, 'c' },
+		{ "threads", required_argument, nullptr, 't' },
+		{ "duration", required_argument, nullptr, 'd' },
+		{ "rate", required_argument, nullptr, 'r' },
+		{ "chat", required_argument, nullptr, OPT_CHAT },
+		{ "ready-timeout", required_argument, nullptr, OPT_READY_TIMEOUT },
+		{ "pid", required_argument, nullptr, OPT_PID },
+		{ "help", no_argument, nullptr, 'h' },
+		{ nullptr, 0, nullptr, 0 }
+	};
+	
+	int c;
+	while ((c = getopt_long(argc, argv, "H:p:c:t:d:r:h", opts, nullptr)) != -1)
+	{
+		switch (c)
+		{
+			case 'H': config.host = optarg; break;
+			case 'p': config.port = std::strtoul(optarg, nullptr, 10); break;
+			case 'c': config.clients = std::strtoul(optarg, nullptr, 10); break;
+			case 't': config.threads = std::strtoul(optarg, nullptr, 10); break;
+			case 'd': config.duration = std::strtoul(optarg, nullptr, 10); break;
+			case 'r': config.rate = std::strtod(optarg, nullptr); break;
+			case OPT_CHAT: config.chat = std::strtod(optarg, nullptr); break;
+			case OPT_READY_TIMEOUT: config.ready_timeout = std::strtoul(optarg, nullptr, 10); break;
+			case OPT_PID: config.pid = std::strtol(optarg, nullptr, 10); break;
+			default:
+				Usage(argv[0]);
+				return false;
+		}
+	}
+	
+	if (config.rate <= 0 || !config.clients)
+	{
+		Usage(argv[0]);
+		return false;
+	}
+	
+	return true;
+}
+
+static uint32_t Percentile(const std::vector<uint32_t> &sorted, double p)
+{
+	if (sorted.empty()) return 0;
+	return sorted[std::min<size_t>(sorted.size()-1, static_cast<size_t>(p*sorted.size()))];
+}
+
+int main(int argc, char **argv)
+{
+	BenchConfig config;
+	if (!ParseArgs(argc, argv, config)) return 1;
+	
+	unsigned nthreads = config.threads ? config.threads : std::max(1u, boost::thread::hardware_concurrency());
+	tcp::endpoint ep(boost::asio::ip::make_address(config.host), config.port);
+	
+	std::vector<std::unique_ptr<boost::asio::io_service>> loops;
+	std::vector<std::unique_ptr<boost::asio::io_service::work>> work;
+	std::vector<Stats> stats(nthreads);
+	std::vector<std::unique_ptr<Client>> clients;
+	
+	for (unsigned i = 0; i < nthreads; i++)
+	{
+		loops.emplace_back(new boost::asio::io_service(1));
+		work.emplace_back(new boost::asio::io_service::work(*loops.back()));
+	}
+	
+	long rss_before = ServerRSS(config.pid);
+	auto start = steady_clock::now();
+	
+	for (unsigned i = 0; i < config.clients; i++)
+	{
+		clients.emplace_back(new Client(*loops[i % nthreads], config, stats[i % nthreads], i+1));
+		boost::asio::post(*loops[i % nthreads], [c = clients.back().get(), ep]() { c->Start(ep); });
+	}
+	
+	boost::thread_group threads;
+	for (auto &l: loops) threads.create_thread([l = l.get()]() { l->run(); });
+	
+	auto deadline = start+std::chrono::seconds(config.ready_timeout);
+	while (ready < config.clients && steady_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	
+	double login_secs = std::chrono::duration<double>(steady_clock::now()-start).count();
+	unsigned logged_in = ready;
+	long rss_after = ServerRSS(config.pid);
+	
+	measuring = true;
+	auto measure_start = steady_clock::now();
+	std::this_thread::sleep_for(std::chrono::seconds(config.duration));
+	measuring = false;
+	double secs = std::chrono::duration<double>(steady_clock::now()-measure_start).count();
+	
+	stopping = true;
+	for (unsigned i = 0; i < config.clients; i++)
+		boost::asio::post(*loops[i % nthreads], [c = clients[i].get()]() { c->Stop(); });
+	work.clear();
+	threads.join_all();
+	
+	Stats total;
+	for (auto &s: stats)
+	{
+		for (int i = 0; i < ST_COUNT; i++)
+			total.latency_us[i].insert(total.latency_us[i].end(), s.latency_us[i].begin(), s.latency_us[i].end());
+		total.sent += s.sent;
+		total.keepalives += s.keepalives;
+		total.chats += s.chats;
+		total.errors += s.errors;
+		total.bytes_in += s.bytes_in;
+		total.bytes_out += s.bytes_out;
+	}
+	
+	printf("clients:     %u of %u logged in after %.2fs (%.0f/s), %llu error(s)\n", logged_in, config.clients,
+		login_secs, logged_in/login_secs, static_cast<unsigned long long>(total.errors));
+	printf("throughput:  %.0f requests/s, %.0f chat round trips/s, %.0f keepalives/s over %.1fs\n",
+		total.sent/secs, total.chats/secs, total.keepalives/secs, secs);
+	printf("traffic:     %.1f MB in, %.1f MB out\n", total.bytes_in/1e6, total.bytes_out/1e6);
+	if (rss_before >= 0 && rss_after >= 0)
+		printf("server RSS:  %ld KiB idle, %ld KiB loaded, %.0f bytes per connection\n", rss_before/1024, rss_after/1024,
+			logged_in ? static_cast<double>(rss_after-rss_before)/logged_in : 0.0);
+	
+	printf("\n%-20s %10s %10s %10s %10s\n", "latency (us)", "count", "p50", "p99", "p999");
+	for (int i = 0; i < ST_COUNT; i++)
+	{
+		auto &l = total.latency_us[i];
+		std::sort(l.begin(), l.end());
+		printf("%-20s %10zu %10u %10u %10u\n", STAGE_NAMES[i], l.size(), Percentile(l, 0.5), Percentile(l, 0.99),
+			Percentile(l, 0.999));
+	}
+	
+	return total.errors ? 1 : 0;
+}
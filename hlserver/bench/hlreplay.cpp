@@ -0,0 +1,370 @@
+// Plays a capture taken with hlserver --capture back at a server, session by session, at the
+// original pace or sped up, so a production load shape can be rerun against any build.
+
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/endian/conversion.hpp>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <getopt.h>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "capture.hpp"
+
+using boost::asio::ip::tcp;
+using std::chrono::steady_clock;
+
+struct ReplayConfig final
+{
+	std::string host = "127.0.0.1";
+	uint16_t port = 5500;
+	double speed = 1.0; // 2 for twice as fast, 0 for as fast as possible
+	unsigned drain_ms = 2000; // how long sessions left open get for their last replies
+};
+
+struct Event final
+{
+	CaptureRecord kind;
+	uint32_t session;
+	uint64_t at; // ns from the start of the capture
+	const uint8_t *data;
+	uint32_t len;
+};
+
+struct Session final
+{
+	tcp::socket sock;
+	std::vector<uint8_t> rx;
+	std::deque<const Event*> tx;
+	bool ready, writing, closing;
+	
+	Session(boost::asio::io_service &io):
+		sock(io),
+		rx(16*1024),
+		ready(false),
+		writing(false),
+		closing(false)
+	{
+	}
+};
+
+class Player final
+{
+public:
+	Player(const ReplayConfig &config, std::vector<Event> &&events):
+		config(config),
+		events(std::move(events)),
+		timer(io),
+		next(0),
+		sent(0),
+		errors(0),
+		bytes_in(0),
+		bytes_out(0),
+		max_lag(0),
+		total_lag(0)
+	{
+		for (auto &e: this->events)
+			if (e.kind == CR_CLOSE) closed.insert(e.session);
+	}
+	
+	void Run()
+	{
+		ep = tcp::endpoint(boost::asio::ip::make_address(config.host), config.port);
+		start = finish = steady_clock::now();
+		boost::asio::post(io, [this]() { Step(); });
+		io.run();
+	}
+	
+	void Report() const
+	{
+		double secs = std::chrono::duration<double>(finish-start).count();
+		double span = events.empty() ? 0 : events.back().at/1e9;
+		
+		printf("replayed:    %zu session(s), %llu transaction(s), %llu error(s)\n", sessions.size(),
+			static_cast<unsigned long long>(sent), static_cast<unsigned long long>(errors));
+		printf("time:        %.2fs for %.2fs of capture (%.2fx)\n", secs, span, secs > 0 ? span/secs : 0.0);
+		printf("throughput:  %.0f transactions/s\n", secs > 0 ? sent/secs : 0.0);
+		printf("traffic:     %.1f MB out, %.1f MB in\n", bytes_out/1e6, bytes_in/1e6);
+		if (config.speed > 0)
+			printf("schedule:    %.3fms behind on average, %.3fms at worst\n",
+				events.empty() ? 0.0 : total_lag/1e6/events.size(), max_lag/1e6);
+	}
+	
+	bool Failed() const
+	{
+		return errors != 0;
+	}
+private:
+	const ReplayConfig &config;
+	std::vector<Event> events;
+	boost::asio::io_service io;
+	boost::asio::steady_timer timer;
+	tcp::endpoint ep;
+	std::map<uint32_t, std::unique_ptr<Session>> sessions;
+	std::set<uint32_t> closed; // sessions the capture saw close, which close themselves
+	size_t next;
+	steady_clock::time_point start, finish; // finish is the last write, so the drain isn't timed
+	uint64_t sent, errors, bytes_in, bytes_out, max_lag, total_lag;
+	
+	void Step()
+	{
+		while (next < events.size())
+		{
+			const Event &e = events[next];
+			
+			if (config.speed > 0)
+			{
+				auto due = start+std::chrono::nanoseconds(static_cast<uint64_t>(e.at/config.speed));
+				auto now = steady_clock::now();
+				
+				if (due > now)
+				{
+					timer.expires_at(due);
+					timer.async_wait([this](boost::system::error_code ec) { if (!ec) Step(); });
+					return;
+				}
+				
+				uint64_t lag = std::chrono::duration_cast<std::chrono::nanoseconds>(now-due).count();
+				max_lag = std::max(max_lag, lag);
+				total_lag += lag;
+			}
+			
+			Execute(e);
+			next++;
+		}
+		
+		// sessions the capture never saw close are still open when it ends; give the server a
+		// moment to answer what they sent last, then close them once they've sent everything
+		timer.expires_after(std::chrono::milliseconds(config.drain_ms));
+		timer.async_wait(
+			[this](boost::system::error_code ec)
+			{
+				if (ec) return;
+				
+				for (auto &s: sessions)
+				{
+					if (closed.count(s.first)) continue;
+					
+					s.second->closing = true;
+					if (s.second->ready && s.second->tx.empty()) Close(*s.second);
+				}
+			});
+	}
+	
+	void Execute(const Event &e)
+	{
+		Session &s = Get(e.session);
+		
+		switch (e.kind)
+		{
+			case CR_OPEN: break;
+			case CR_DATA:
+				s.tx.push_back(&e);
+				if (s.ready && !s.writing) Flush(s);
+				break;
+			case CR_CLOSE:
+				s.closing = true;
+				if (s.ready && s.tx.empty()) Close(s);
+				break;
+		}
+	}
+	
+	Session& Get(uint32_t id)
+	{
+		// a session whose opening got dropped from the capture still gets connected
+		auto &s = sessions[id];
+		if (s) return *s;
+		
+		s.reset(new Session(io));
+		Session *p = s.get();
+		
+		p->sock.async_connect(ep,
+			[this, p](boost::system::error_code ec)
+			{
+				if (ec) return Fail(*p, ec);
+				
+				static const uint8_t hello[12] = { 'T', 'R', 'T', 'P', 'H', 'O', 'T', 'L', 0, 1, 0, 2 };
+				boost::asio::async_write(p->sock, boost::asio::buffer(hello),
+					[this, p](boost::system::error_code ec, size_t)
+					{
+						if (ec) return Fail(*p, ec);
+						
+						boost::asio::async_read(p->sock, boost::asio::buffer(p->rx.data(), 8),
+							[this, p](boost::system::error_code ec, size_t)
+							{
+								if (ec) return Fail(*p, ec);
+								
+								p->ready = true;
+								Drain(*p);
+								if (!p->tx.empty())
+									Flush(*p);
+								else if (p->closing)
+									Close(*p);
+							});
+					});
+			});
+		
+		return *p;
+	}
+	
+	void Flush(Session &s)
+	{
+		s.writing = true;
+		
+		const Event *e = s.tx.front();
+		boost::asio::async_write(s.sock, boost::asio::buffer(e->data, e->len),
+			[this, &s](boost::system::error_code ec, size_t n)
+			{
+				s.writing = false;
+				if (ec) return Fail(s, ec);
+				
+				bytes_out += n;
+				++sent;
+				finish = steady_clock::now();
+				s.tx.pop_front();
+				
+				if (!s.tx.empty())
+					Flush(s);
+				else if (s.closing)
+					Close(s);
+			});
+	}
+	
+	void Drain(Session &s)
+	{
+		// the replies don't matter, but left unread they'd back up and get us dropped
+		s.sock.async_read_some(boost::asio::buffer(s.rx),
+			[this, &s](boost::system::error_code ec, size_t n)
+			{
+				if (ec) return;
+				
+				bytes_in += n;
+				Drain(s);
+			});
+	}
+	
+	void Close(Session &s)
+	{
+		boost::system::error_code ec;
+		s.sock.shutdown(tcp::socket::shutdown_both, ec);
+		s.sock.close(ec);
+	}
+	
+	void Fail(Session &s, const boost::system::error_code &ec)
+	{
+		if (!errors++) std::cerr << "Replay: " << ec.message() << '\n';
+		s.tx.clear();
+		Close(s);
+	}
+};
+
+static bool Load(const std::string &path, std::vector<uint8_t> &file, std::vector<Event> &events)
+{
+	std::ifstream f(path, std::ios::binary);
+	if (!f)
+	{
+		std::cerr << "Can't open " << path << '\n';
+		return false;
+	}
+	file.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+	
+	if (file.size() < CAPTURE_HEADER_SIZE || std::memcmp(file.data(), CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0)
+	{
+		std::cerr << path << " isn't a capture\n";
+		return false;
+	}
+	
+	size_t at = CAPTURE_HEADER_SIZE;
+	while (file.size()-at >= CAPTURE_RECORD_SIZE)
+	{
+		const uint8_t *p = file.data()+at;
+		Event e;
+		e.kind = static_cast<CaptureRecord>(p[0]);
+		e.session = boost::endian::load_big_u32(p+1);
+		e.at = boost::endian::load_big_u64(p+5);
+		e.len = boost::endian::load_big_u32(p+13);
+		e.data = p+CAPTURE_RECORD_SIZE;
+		
+		if (file.size()-at-CAPTURE_RECORD_SIZE < e.len) break; // the server died mid-write
+		if (e.kind >= CR_OPEN && e.kind <= CR_CLOSE) events.push_back(e);
+		at += CAPTURE_RECORD_SIZE+e.len;
+	}
+	
+	// records are stamped just before they're queued, so neighbours can be a hair out of order
+	std::stable_sort(events.begin(), events.end(), [](const Event &a, const Event &b) { return a.at < b.at; });
+	return true;
+}
+
+static void Usage(const char *self)
+{
+	std::cerr << "Usage: " << self << " [options] <capture>\n"
+		"  -H, --host <addr>           server address (default 127.0.0.1)\n"
+		"  -p, --port <n>              server port (default 5500)\n"
+		"  -s, --speed <f>             playback speed, 0 for as fast as possible (default 1)\n"
+		"  -d, --drain <ms>            time the server gets to answer before sessions the capture\n"
+		"                              left open are closed (default 2000)\n";
+}
+
+int main(int argc, char **argv)
+{
+	static const option opts[] =
+	{
+		{ "host", required_argument, nullptr, 'H' },
+		{ "port", required_argument, nullptr, 'p' },
+		{ "speed", required_argument, nullptr, 's' },
+		{ "drain", required_argument, nullptr, 'd' },
+		{ "help", no_argument, nullptr, 'h' },
+		{ nullptr, 0, nullptr, 0 }
+	};
+	
+	ReplayConfig config;
+	
+	int c;
+	while ((c = getopt_long(argc, argv, "H:p:s:d:h", opts, nullptr)) != -1)
+	{
+		switch (c)
+		{
+			case 'H': config.host = optarg; break;
+			case 'p': config.port = std::strtoul(optarg, nullptr, 10); break;
+			case 's': config.speed = std::strtod(optarg, nullptr); break;
+			case 'd': config.drain_ms = std::strtoul(optarg, nullptr, 10); break;
+			default:
+				Usage(argv[0]);
+				return 1;
+		}
+	}
+	
+	if (optind != argc-1 || config.speed < 0)
+	{
+		Usage(argv[0]);
+		return 1;
+	}
+	
+	std::vector<uint8_t> file;
+	std::vector<Event> events;
+	if (!Load(argv[optind], file, events)) return 1;
+	
+	try
+	{
+		Player player(config, std::move(events));
+		player.Run();
+		player.Report();
+		return player.Failed() ? 1 : 0;
+	}
+	catch (std::exception &e)
+	{
+		std::cerr << "Exception caught: " << e.what() << '\n';
+		return 1;
+	}
+}
@@ -0,0 +1,149 @@
+// Drives HostResolver through a stub backend instead of DNS and checks what the cache does with
+// a hit, a miss, lookups for one address arriving together, and a failed lookup that's tried
+// again once its shorter TTL is up. Exits non-zero if anything's off.
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <future>
+#include <getopt.h>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "resolver.hpp"
+
+using boost::asio::ip::address;
+
+// Answers from a table, counting how often it's asked; an address that isn't in it fails
+class Stub final
+{
+public:
+	std::map<address, std::string> names;
+	std::atomic<int> delay_ms{0};
+	
+	bool operator()(const address &addr, std::string &host)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms.load()));
+		
+		std::lock_guard<std::mutex> guard(lock);
+		calls[addr]++;
+		auto it = names.find(addr);
+		if (it == names.end()) return false;
+		host = it->second;
+		return true;
+	}
+	
+	unsigned Calls(const address &addr)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		return calls[addr];
+	}
+	
+	void Answer(const address &addr, const std::string &host)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		names[addr] = host;
+	}
+private:
+	std::mutex lock;
+	std::map<address, unsigned> calls;
+};
+
+static int failures = 0;
+
+static void Check(bool ok, const std::string &what)
+{
+	std::cout << (ok ? "ok    " : "FAIL  ") << what << '\n';
+	if (!ok) failures++;
+}
+
+static std::string Resolve(HostResolver &r, const address &addr)
+{
+	auto done = std::make_shared<std::promise<std::string>>();
+	auto got = done->get_future();
+	r.Resolve(addr, [done](const std::string &host) { done->set_value(host); });
+	return got.get();
+}
+
+static void Usage(const char *self)
+{
+	std::cerr << "Usage: " << self << " [options]\n"
+		"  -r, --retry <n>             seconds a failed lookup is kept (default " << RESOLVER_RETRY_SECONDS << ")\n";
+}
+
+int main(int argc, char **argv)
+{
+	static const option opts[] =
+	{
+		{ "retry", required_argument, nullptr, 'r' },
+		{ "help", no_argument, nullptr, 'h' },
+		{ nullptr, 0, nullptr, 0 }
+	};
+	
+	std::chrono::seconds retry(RESOLVER_RETRY_SECONDS);
+	
+	int c;
+	while ((c = getopt_long(argc, argv, "r:h", opts, nullptr)) != -1)
+	{
+		switch (c)
+		{
+			case 'r': retry = std::chrono::seconds(std::strtoul(optarg, nullptr, 10)); break;
+			default:
+				Usage(argv[0]);
+				return 1;
+		}
+	}
+	
+	if (optind != argc || retry.count() < 1)
+	{
+		Usage(argv[0]);
+		return 1;
+	}
+	
+	// the full TTL has to outlast the retry, or the two can't be told apart
+	auto stub = std::make_shared<Stub>();
+	HostResolver r(2, 2, retry*10, retry);
+	r.SetBackend([stub](const address &addr, std::string &host) { return (*stub)(addr, host); });
+	
+	address a = address::from_string("192.0.2.1"), b = address::from_string("192.0.2.2");
+	address down = address::from_string("192.0.2.3"), d = address::from_string("192.0.2.4");
+	stub->Answer(a, "a.example");
+	stub->Answer(b, "b.example");
+	stub->Answer(d, "d.example");
+	
+	// miss, then hit
+	Check(Resolve(r, a) == "a.example" && stub->Calls(a) == 1, "a miss asks the backend");
+	Check(Resolve(r, a) == "a.example" && stub->Calls(a) == 1, "a hit doesn't");
+	
+	// everyone asking while a lookup is under way shares it
+	stub->delay_ms = 200;
+	std::vector<std::future<std::string>> waiting;
+	for (int i = 0; i < 8; i++) waiting.push_back(std::async(std::launch::async, [&]() { return Resolve(r, b); }));
+	bool all = true;
+	for (auto &w: waiting) all = all && w.get() == "b.example";
+	Check(all && stub->Calls(b) == 1, "8 lookups of one address at once make one backend call");
+	stub->delay_ms = 0;
+	
+	// a failure falls back on the address, for the retry TTL only
+	Check(Resolve(r, down) == "192.0.2.3" && stub->Calls(down) == 1, "a failed lookup gives the address");
+	Check(Resolve(r, down) == "192.0.2.3" && stub->Calls(down) == 1, "and is cached for a while");
+	
+	stub->Answer(down, "back.example");
+	std::cout << "      waiting " << retry.count() << "s for the retry TTL\n";
+	std::this_thread::sleep_for(retry+std::chrono::milliseconds(200));
+	
+	Check(Resolve(r, down) == "back.example" && stub->Calls(down) == 2, "after the retry TTL it's looked up again");
+	Check(Resolve(r, b) == "b.example" && stub->Calls(b) == 1, "while a good answer is still cached");
+	
+	// there's room for 2, b was used last, so down makes way for d
+	Resolve(r, d);
+	Check(Resolve(r, b) == "b.example" && stub->Calls(b) == 1, "the most recently used address stays");
+	Check(Resolve(r, down) == "back.example" && stub->Calls(down) == 3, "the least recently used one is evicted");
+	
+	std::cout << (failures ? "FAILED" : "PASSED") << '\n';
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,74 @@
+#ifndef _ACCOUNTS_H
+#define _ACCOUNTS_H
+
+#include <bitset>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+#include <sqlite3.h>
+#include <string>
+#include <unordered_map>
+
+#include "users.hpp"
+
+// what everybody used to get, less account management and disconnecting people
+static const uint64_t GUEST_ACCESS = 0xFFF00CEFFF800000ULL;
+static const uint64_t ADMIN_ACCESS = 0xFFFFFFFFFFFF8000ULL; // every UserAccess bit
+
+struct Account final
+{
+	std::string login, name;
+	uint8_t pw_sum[SHA256_DIGEST_LENGTH]; // SHA-256 of the plain text password
+	std::bitset<USER_ACCESS_BITS> access;
+	
+	bool CheckPassword(const std::string &password, EVP_MD_CTX*) const;
+	void SetPassword(const std::string &password);
+};
+
+// F_USERACCESS puts UA_DELETEFILE in the most significant bit
+std::bitset<USER_ACCESS_BITS> AccessFromWire(uint64_t);
+uint64_t AccessToWire(const std::bitset<USER_ACCESS_BITS>&);
+
+// Accounts live in SQLite, but logins are answered from a cache in front of it so a crowd
+// reconnecting after a restart costs one query per account, not one per connection. The cache
+// only holds accounts that exist, least recently used out first, so nobody can push the real
+// ones out by trying made up logins.
+class AccountStore final
+{
+public:
+	AccountStore(const std::string &path, size_t cache_size);
+	~AccountStore();
+	std::shared_ptr<const Account> Find(const std::string &login);
+	bool Create(const Account&);
+	bool Update(const Account&);
+	bool Remove(const std::string &login);
+private:
+	sqlite3 *db;
+	sqlite3_stmt *select, *insert, *update, *erase;
+	std::mutex db_lock; // one connection, so one statement at a time
+	
+	struct Cached
+	{
+		std::shared_ptr<const Account> account;
+		std::list<std::string>::iterator lru;
+	};
+	
+	std::mutex cache_lock;
+	std::unordered_map<std::string, Cached> cache;
+	std::list<std::string> lru; // most recently found first
+	uint64_t generation; // bumped by every write, so a lookup racing one doesn't cache stale data
+	size_t cache_size;
+	
+	void Close();
+	void Exec(const char *sql);
+	sqlite3_stmt* Prepare(const char *sql);
+	void Bind(sqlite3_stmt*, const Account&);
+	bool Step(sqlite3_stmt*);
+	void Invalidate(const std::string &login);
+	void Bootstrap();
+};
+
+#endif // _ACCOUNTS_H
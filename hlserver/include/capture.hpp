@@ -0,0 +1,59 @@
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A capture file starts with CAPTURE_MAGIC and the wall clock time it was started at (big endian
+// nanoseconds since the epoch), followed by records of
+//   uint8 kind, uint32 session, uint64 nanoseconds since the start, uint32 length, length bytes
+// all big endian. Sessions are numbered in the order they finished their handshake.
+enum CaptureRecord: uint8_t
+{
+	CR_OPEN = 1, // handshake done, no data
+	CR_DATA, // one whole transaction as the client sent it
+	CR_CLOSE // no data
+};
+
+enum
+{
+	CAPTURE_HEADER_SIZE = 16,
+	CAPTURE_RECORD_SIZE = 17, // not counting the data
+	MAX_CAPTURE_BACKLOG = 64*1024*1024 // bytes not yet on disk before records get dropped
+};
+
+static const char CAPTURE_MAGIC[8] = { 'H', 'L', 'C', 'A', 'P', 0, 0, 1 };
+
+// Records what clients send so hlreplay can play it back later. Recording only copies into a
+// buffer; a thread of its own writes it out.
+class Capture final
+{
+public:
+	Capture(const std::string &path);
+	~Capture();
+	uint32_t Open();
+	void Data(uint32_t session, const uint8_t*, uint32_t len);
+	void Close(uint32_t session);
+private:
+	std::mutex lock;
+	std::condition_variable wake;
+	std::vector<uint8_t> backlog;
+	uint64_t dropped;
+	bool stop;
+	FILE *out;
+	std::chrono::steady_clock::time_point start;
+	std::atomic<uint32_t> next_session;
+	std::thread writer;
+	
+	void Append(CaptureRecord, uint32_t session, const uint8_t*, uint32_t len);
+	void Run();
+};
+
+#endif // _CAPTURE_H
@@ -0,0 +1,33 @@
+#ifndef _CRYPTO_H
+#define _CRYPTO_H
+
+#include <atomic>
+#include <boost/asio.hpp>
+#include <boost/thread.hpp>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "accounts.hpp"
+
+// Password checks off the event loops. However slow hashing gets, a crowd logging in makes
+// logins slower, not chat. The queue is bounded: past max_queue checks waiting, Verify turns
+// new ones away on the spot rather than letting them pile up.
+class CryptoPool final
+{
+public:
+	typedef std::function<void(bool)> Callback; // called on a worker thread
+	
+	CryptoPool(unsigned nthreads, size_t max_queue);
+	~CryptoPool();
+	// false if the queue is full, the callback never runs then
+	bool Verify(std::shared_ptr<const Account>, std::string password, Callback);
+private:
+	boost::asio::io_service io;
+	std::unique_ptr<boost::asio::io_service::work> work;
+	boost::thread_group threads;
+	std::atomic<size_t> queued;
+	size_t max_queue;
+};
+
+#endif // _CRYPTO_H
@@ -0,0 +1,114 @@
+#ifndef _FILES_H
+#define _FILES_H
+
+#include <boost/asio.hpp>
+#include <boost/thread.hpp>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "transactions.hpp"
+
+enum
+{
+	FILE_LIST_THREADS = 2 // reading folders that aren't cached yet
+};
+
+// Paths arrive as F_FILEPATH: a uint16 count, then that many (uint16 reserved, uint8 length,
+// name) entries. Anything that could climb out of the file root is refused.
+bool ValidFileName(std::string_view);
+bool DecodeFilePath(const std::optional<ParamView>&, std::string &rel); // rel is "" for the root, "a/b" below it
+void EncodeFilePath(std::vector<uint8_t>&, std::string_view rel); // appended, without a field header
+
+inline std::string JoinPath(const std::string &dir, std::string_view name)
+{
+	if (dir.empty()) return std::string(name);
+	if (name.empty()) return dir;
+	return dir + '/' + std::string(name);
+}
+
+// Mac type and creator codes for a file name, guessed from its extension
+void FileTypeCodes(std::string_view name, char type[4], char creator[4]);
+// An F_FILENAMEWITHINFO field, appended. A folder's type is 'fldr' and its size is how many items are in it.
+void EncodeFileRecord(std::vector<uint8_t>&, std::string_view name, const char type[4], const char creator[4], uint32_t size);
+// Dot files and uploads still in progress aren't shown to clients
+bool HiddenFile(std::string_view);
+
+// The OP_GETFILENAMELIST reply fields per folder, kept encoded. inotify tells us what changed,
+// and only that entry's record gets patched, so a listing is a copy of a shared buffer however
+// big the folder is and however many people open it. Every subfolder in a cached listing is
+// watched as well, so the item count shown for it stays right.
+class FileListCache final
+{
+public:
+	struct Listing
+	{
+		std::shared_ptr<const std::vector<uint8_t>> fields;
+		uint16_t count;
+	};
+	
+	FileListCache(const std::string &root, size_t capacity);
+	~FileListCache();
+	// a cached folder is answered right away; any other is read on a thread of its own, and
+	// whoever asks for it meanwhile waits for that one read. found is false if there's no such folder.
+	typedef std::function<void(bool found, const Listing&)> Listed;
+	void List(const std::string &rel, Listed);
+private:
+	struct Folder
+	{
+		std::vector<uint8_t> fields; // F_FILENAMEWITHINFO records, sorted by name
+		uint16_t count = 0;
+		Listing published;
+		bool dirty = false;
+		int wd = -1;
+		std::unordered_map<std::string, int> counted; // subfolders by name, and the watches on them
+		std::list<std::string>::iterator lru;
+		
+		void Patch(std::string_view name, const std::vector<uint8_t> *rec);
+		void SetSize(std::string_view name, uint32_t size);
+	};
+	
+	struct Reading
+	{
+		bool changed = false; // the folder changed while it was being read
+		std::vector<Listed> waiting;
+	};
+	
+	struct Watch
+	{
+		std::string rel; // the folder it's on
+		unsigned uses; // its own listing and its parent's
+	};
+	
+	std::string root;
+	size_t capacity;
+	std::mutex lock;
+	std::unordered_map<std::string, Folder> folders;
+	std::unordered_map<int, Watch> watches;
+	std::unordered_map<std::string, Reading> building; // folders being read
+	std::list<std::string> lru; // most recently listed first
+	int inotify, stop;
+	std::thread watcher;
+	boost::asio::io_service reading;
+	std::unique_ptr<boost::asio::io_service::work> reading_work;
+	boost::thread_group readers;
+	
+	void Read(const std::string &rel);
+	bool Build(const std::string &rel, Folder&, bool watch);
+	bool Describe(const std::string &rel, std::string_view name, std::vector<uint8_t> &rec, int *wd);
+	int AddWatch(const std::string &rel);
+	void Release(int wd);
+	void Drop(const std::string &rel, bool below);
+	void Run();
+	void Handle(int wd, uint32_t mask, const std::string &name);
+};
+
+#endif // _FILES_H
@@ -3,11 +3,14 @@
 
 #include <boost/endian/arithmetic.hpp>
 #include <chrono>
+#include <cstring>
 #include <istream>
 #include <ostream>
 #include <sstream>
 #include <string>
 
+#include "log.hpp"
+
 using namespace boost::endian;
 
 struct DateTime final
@@ -16,15 +19,15 @@ struct DateTime final
 	big_uint16_t msecs;
 	big_uint32_t secs;
 	
-	DateTime(std::istream&);
+	DateTime(const uint8_t*);
 	std::chrono::system_clock::time_point TimePoint() const;
 	void FromTimePoint(const std::chrono::system_clock::time_point&);
 	
-	void Write(std::ostream &s) const
+	void Write(uint8_t *p) const
 	{
-		s.write(reinterpret_cast<const char*>(&year), 2);
-		s.write(reinterpret_cast<const char*>(&msecs), 2);
-		s.write(reinterpret_cast<const char*>(&secs), 4);
+		std::memcpy(p, &year, 2);
+		std::memcpy(p+2, &msecs, 2);
+		std::memcpy(p+4, &secs, 4);
 	}
 	
 	bool operator<(const DateTime&) const;
@@ -45,8 +48,6 @@ struct DateTime final
 	}
 };
 
-void Log(std::string);
-
 inline std::string ConvertString(std::string s)
 {
 	for (int i = 0; i < s.size(); i++) s[i] = ~s[i];
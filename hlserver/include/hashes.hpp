@@ -0,0 +1,92 @@
+#ifndef _HASHES_H
+#define _HASHES_H
+
+#include <boost/asio.hpp>
+#include <boost/thread.hpp>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <openssl/evp.h>
+#include <openssl/md5.h>
+#include <openssl/sha.h>
+#include <sqlite3.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "transfers.hpp"
+
+enum
+{
+	HASH_SLICE = 16*1024*1024, // bytes one file gets hashed before letting the others have a go
+	HASH_BUFFER_SIZE = 1024*1024
+};
+
+struct FileHashes final
+{
+	uint8_t md5[MD5_DIGEST_LENGTH];
+	uint8_t sha1[SHA_DIGEST_LENGTH];
+};
+
+// MD5 and SHA-1 of files, worked out on a pool of threads and kept in SQLite by device and inode,
+// along with the size and modification time they were taken at, so a file is only read again once
+// it's changed, restarts or not. Every file goes a slice at a time, so a big one doesn't hold up
+// the rest, and two asking about the same file share the one read. Alongside, the pool works
+// through the whole file root in the background, one file at a time.
+class HashPool final
+{
+public:
+	typedef std::function<void(bool ok, const FileHashes&)> Callback; // called on a worker thread
+	
+	HashPool(const std::string &db_path, const std::string &root, unsigned nthreads, bool sweep);
+	~HashPool();
+	void Hash(const std::string &path, Callback);
+private:
+	struct Key
+	{
+		uint64_t dev, ino, size;
+		int64_t mtime; // nanoseconds
+	};
+	
+	struct Job
+	{
+		std::string path;
+		Key key;
+		int fd;
+		EVP_MD_CTX *md5, *sha1;
+		std::vector<Callback> waiting;
+		
+		Job(): fd(-1), md5(EVP_MD_CTX_new()), sha1(EVP_MD_CTX_new()) {}
+		~Job();
+		Job(const Job&) = delete;
+		Job& operator=(const Job&) = delete;
+	};
+	
+	boost::asio::io_service io;
+	std::unique_ptr<boost::asio::io_service::work> work;
+	boost::thread_group threads;
+	std::string root;
+	
+	sqlite3 *db;
+	sqlite3_stmt *select, *upsert;
+	std::mutex db_lock; // one connection, so one statement at a time
+	
+	std::mutex lock;
+	std::map<std::pair<uint64_t, uint64_t>, std::shared_ptr<Job>> running; // by device and inode
+	std::unique_ptr<FolderWalk> sweep; // only ever touched by the one background chain
+	uint64_t swept;
+	
+	void Close();
+	void Exec(const char *sql);
+	sqlite3_stmt* Prepare(const char *sql);
+	bool Lookup(const Key&, FileHashes&);
+	void Store(const Key&, const FileHashes&);
+	void Start(const std::string &path, Callback);
+	void Step(std::shared_ptr<Job>);
+	void Finish(std::shared_ptr<Job>, bool ok);
+	void Sweep();
+};
+
+#endif // _HASHES_H
@@ -0,0 +1,99 @@
+#ifndef _LOG_H
+#define _LOG_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+enum LogLevel: uint8_t
+{
+	LL_DEBUG = 0,
+	LL_INFO,
+	LL_WARNING,
+	LL_ERROR
+};
+
+enum
+{
+	LOG_RING_SIZE = 8192 // records waiting to be written, must be a power of two
+};
+
+struct LogConfig final
+{
+	std::string path; // empty for stdout
+	uint64_t max_size = 64*1024*1024; // rotate once the file grows past this
+	unsigned keep = 5; // rotated files to hang on to
+	LogLevel level = LL_INFO;
+};
+
+// Log() only ever claims a slot in a lock-free ring; formatting and the actual write happen on a
+// thread of the logger's own, so a slow terminal or disk never holds up an event loop. When the
+// ring is full the record is dropped and counted instead of waiting.
+class Logger final
+{
+public:
+	static Logger& Instance();
+	
+	~Logger();
+	void Configure(const LogConfig&);
+	void Push(LogLevel, std::string);
+	
+	bool Enabled(LogLevel l) const
+	{
+		return l >= level.load(std::memory_order_relaxed);
+	}
+	
+	uint64_t Dropped() const
+	{
+		return dropped.load(std::memory_order_relaxed);
+	}
+private:
+	struct Slot
+	{
+		std::atomic<size_t> seq;
+		std::chrono::system_clock::time_point when;
+		LogLevel level;
+		std::string text;
+	};
+	
+	std::unique_ptr<Slot[]> ring;
+	alignas(64) std::atomic<size_t> head; // next slot to claim
+	alignas(64) size_t tail; // next slot to write, only touched by the writer
+	std::atomic<uint64_t> dropped;
+	std::atomic<LogLevel> level;
+	std::atomic<bool> idle, stop;
+	std::mutex wake_lock;
+	std::condition_variable wake;
+	
+	std::mutex config_lock; // only for handing a new config to the writer
+	std::unique_ptr<LogConfig> next_config;
+	std::atomic<bool> reconfigure;
+	
+	LogConfig config;
+	FILE *out;
+	uint64_t out_size, reported_drops;
+	std::thread writer;
+	
+	Logger();
+	void Run();
+	bool Drain();
+	void Write(std::chrono::system_clock::time_point, LogLevel, const std::string&);
+	void WriteLine(const std::string&);
+	void Open();
+	void Rotate();
+};
+
+void Log(LogLevel, std::string);
+
+inline void Log(std::string txt)
+{
+	Log(LL_INFO, std::move(txt));
+}
+
+#endif // _LOG_H
@@ -0,0 +1,69 @@
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+enum Counter
+{
+	MC_ACCEPTS = 0,
+	MC_BYTES_IN,
+	MC_BYTES_OUT,
+	MC_QUEUED_BYTES, // a gauge, so it goes both ways
+	MC_DROPPED_FRAMES,
+	MC_LOGINS_REFUSED, // the crypto pool was full
+	MC_TRANSFER_BYTES_OUT,
+	MC_TRANSFER_BYTES_IN,
+	MC_ACTIVE_TRANSFERS, // a gauge
+	MC_COUNT
+};
+
+enum
+{
+	MAX_METRIC_OPCODE = 1024, // anything at or above this is lumped in with the unknowns
+	LATENCY_SUB_BITS = 3, // 8 sub-buckets per power of two, so within 12.5%
+	LATENCY_BUCKETS = (40-LATENCY_SUB_BITS+1) << LATENCY_SUB_BITS // up to about 18 minutes in ns
+};
+
+// Counters and latency histograms kept per thread, so recording is a plain load and store on
+// memory no other thread writes. A scrape adds the shards up.
+class Metrics final
+{
+public:
+	static void Add(Counter c, int64_t n)
+	{
+		auto &v = Local().counters[c];
+		v.store(v.load(std::memory_order_relaxed)+n, std::memory_order_relaxed);
+	}
+	
+	// opcode 0 for transactions nobody handles
+	static void Record(uint16_t opcode, std::chrono::nanoseconds);
+	static void Expose(std::string&);
+private:
+	struct OpStats
+	{
+		std::atomic<uint64_t> count, sum_ns;
+		std::array<std::atomic<uint64_t>, LATENCY_BUCKETS> buckets;
+	};
+	
+	struct Shard
+	{
+		std::array<std::atomic<int64_t>, MC_COUNT> counters;
+		std::array<std::atomic<OpStats*>, MAX_METRIC_OPCODE> ops; // allocated on first use
+	};
+	
+	static std::mutex lock; // guards the shard list, never taken while recording
+	static std::vector<std::unique_ptr<Shard>> shards;
+	
+	static Shard& Local();
+	static size_t Bucket(uint64_t ns);
+	static uint64_t BucketLimit(size_t);
+};
+
+#endif // _METRICS_H
@@ -0,0 +1,116 @@
+#ifndef _POOL_H
+#define _POOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <vector>
+
+enum
+{
+	MAX_POOLED_BLOCKS = 1024, // per size, per thread
+	MAX_POOLED_BUFFERS = 64, // per thread
+	MAX_POOLED_BUFFER_SIZE = 64*1024 // anything bigger goes back to the heap
+};
+
+// Thread-local free lists of fixed-size blocks. A block released on another thread than the
+// one that allocated it simply joins the releasing thread's list.
+template <size_t Size>
+class BlockPool final
+{
+public:
+	static void* Allocate()
+	{
+		FreeList &l = List();
+		
+		if (!l.head) return ::operator new(BlockSize);
+		
+		Node *n = l.head;
+		l.head = n->next;
+		--l.count;
+		return n;
+	}
+	
+	static void Release(void *p)
+	{
+		FreeList &l = List();
+		
+		if (l.count >= MAX_POOLED_BLOCKS)
+		{
+			::operator delete(p);
+			return;
+		}
+		
+		Node *n = static_cast<Node*>(p);
+		n->next = l.head;
+		l.head = n;
+		++l.count;
+	}
+private:
+	struct Node
+	{
+		Node *next;
+	};
+	
+	struct FreeList
+	{
+		Node *head = nullptr;
+		size_t count = 0;
+		
+		~FreeList()
+		{
+			while (head)
+			{
+				Node *n = head;
+				head = n->next;
+				::operator delete(n);
+			}
+		}
+	};
+	
+	static constexpr size_t BlockSize = Size < sizeof(Node) ? sizeof(Node) : Size;
+	
+	static FreeList& List()
+	{
+		thread_local FreeList l;
+		return l;
+	}
+};
+
+// For std::allocate_shared and friends, so the object and its control block come from a pool
+template <class T>
+struct PoolAllocator final
+{
+	typedef T value_type;
+	
+	PoolAllocator() = default;
+	template <class U> PoolAllocator(const PoolAllocator<U>&) {}
+	
+	T* allocate(size_t n)
+	{
+		if (n != 1) return static_cast<T*>(::operator new(n*sizeof(T)));
+		return static_cast<T*>(BlockPool<sizeof(T)>::Allocate());
+	}
+	
+	void deallocate(T *p, size_t n)
+	{
+		if (n != 1)
+			::operator delete(p);
+		else
+			BlockPool<sizeof(T)>::Release(p);
+	}
+	
+	template <class U> bool operator==(const PoolAllocator<U>&) const { return true; }
+	template <class U> bool operator!=(const PoolAllocator<U>&) const { return false; }
+};
+
+// Byte buffers for frame payloads. A buffer is handed out again once every frame that
+// shared it has been written and let go of it.
+class BufferPool final
+{
+public:
+	static std::shared_ptr<std::vector<uint8_t>> Get(size_t size);
+};
+
+#endif // _POOL_H
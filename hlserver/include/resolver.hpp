@@ -0,0 +1,59 @@
+#ifndef _RESOLVER_H
+#define _RESOLVER_H
+
+#include <boost/asio.hpp>
+#include <boost/thread.hpp>
+#include <chrono>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using boost::asio::ip::tcp;
+
+enum
+{
+	RESOLVER_RETRY_SECONDS = 60 // how long a lookup that failed is remembered, rather than the whole TTL
+};
+
+// Reverse DNS off the event loops, with a cache shared by all of them
+class HostResolver final
+{
+public:
+	typedef std::function<void(const std::string&)> Callback;
+	// The lookup itself, run on one of the resolver's threads: the host name, or false if the
+	// lookup failed. getnameinfo() unless a stub is swapped in, so the cache can be tried without DNS.
+	typedef std::function<bool(const boost::asio::ip::address&, std::string &host)> Backend;
+	
+	HostResolver(unsigned nthreads, size_t capacity, std::chrono::seconds ttl,
+		std::chrono::seconds retry = std::chrono::seconds(RESOLVER_RETRY_SECONDS));
+	~HostResolver();
+	void SetBackend(Backend);
+	void Resolve(const boost::asio::ip::address&, Callback);
+private:
+	struct Entry
+	{
+		std::string host;
+		std::chrono::steady_clock::time_point expires;
+		std::list<boost::asio::ip::address>::iterator lru;
+	};
+	
+	std::mutex lock;
+	std::map<boost::asio::ip::address, Entry> cache;
+	std::list<boost::asio::ip::address> lru; // most recently used first
+	std::map<boost::asio::ip::address, std::vector<Callback>> pending; // lookups in progress
+	boost::asio::io_service io;
+	std::unique_ptr<boost::asio::io_service::work> work;
+	boost::thread_group threads;
+	Backend backend;
+	size_t capacity;
+	std::chrono::seconds ttl, retry;
+	
+	void Lookup(const boost::asio::ip::address&);
+	void Store(const boost::asio::ip::address&, const std::string&, std::chrono::seconds ttl);
+};
+
+#endif // _RESOLVER_H
@@ -0,0 +1,97 @@
+#ifndef _SEARCH_H
+#define _SEARCH_H
+
+#include <boost/asio.hpp>
+#include <boost/thread.hpp>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+enum
+{
+	SEARCH_MAX_RESULTS = 500,
+	SEARCH_PREFIX = 1, // F_OPTIONS: match the start of a word in the name, not anywhere in it
+	INDEX_COMPACT_AFTER = 4096 // removed entries before the postings are rebuilt without them
+};
+
+// Every file and folder under the file root, for OP_INDEX. Names are indexed by word for prefix
+// searches and by every run of three characters for substring ones, so a search only looks at
+// names that could match. The first build reads folders in parallel on a pool of its own; after
+// that, inotify keeps it current.
+class FileIndex final
+{
+public:
+	struct Query
+	{
+		std::string text; // matched without regard to case
+		bool prefix = false;
+		std::optional<uint32_t> type, creator; // Mac codes, as big-endian integers
+		uint64_t min_size = 0;
+	};
+	
+	struct Progress
+	{
+		uint32_t items, folders_left; // folders_left is 0 once the first build is done
+	};
+	
+	FileIndex(const std::string &root, unsigned nthreads);
+	~FileIndex();
+	// appends an F_FILENAMEWITHINFO, then the F_FILEPATH of the folder it's in, per hit; the number of hits
+	uint16_t Search(const Query&, std::vector<uint8_t> &fields);
+	Progress Status();
+private:
+	struct Entry
+	{
+		std::string name, key; // key is the name in lower case
+		uint32_t parent;
+		uint32_t count; // a folder's items
+		uint64_t size;
+		char type[4], creator[4];
+		bool folder, dead;
+		int wd;
+	};
+	
+	struct Found
+	{
+		std::string name;
+		struct stat st;
+	};
+	
+	std::string root;
+	boost::asio::io_service io;
+	std::unique_ptr<boost::asio::io_service::work> work;
+	boost::thread_group threads;
+	std::shared_mutex lock;
+	std::vector<Entry> entries; // 0 is the root
+	std::map<std::string, uint32_t> paths; // ordered, so everything under a folder is one range
+	std::unordered_map<uint32_t, std::vector<uint32_t>> grams; // ascending entry numbers
+	std::map<std::string, std::vector<uint32_t>> words;
+	std::unordered_map<int, std::string> watches;
+	std::unordered_map<std::string, bool> building; // folders being read; true if they changed meanwhile
+	uint32_t live, dead, folders_left;
+	std::chrono::steady_clock::time_point started;
+	bool ready, out_of_watches;
+	int inotify, stop;
+	std::thread watcher;
+	
+	void Read(const std::string &rel);
+	void Add(const std::string &rel, const struct stat&);
+	void Index(uint32_t id);
+	void Remove(const std::string &rel);
+	void Compact();
+	void Reset();
+	void Run();
+	void Handle(int wd, uint32_t mask, const std::string &name);
+	std::string PathOf(uint32_t id) const;
+};
+
+#endif // _SEARCH_H
@@ -4,12 +4,22 @@
 #include <boost/asio.hpp>
 #include <boost/endian/arithmetic.hpp>
 #include <boost/thread.hpp>
+#include <chrono>
 #include <cstdint>
-#include <map>
-#include <openssl/sha.h>
-#include <sqlite3.h>
+#include <memory>
+#include <mutex>
 #include <vector>
 
+#include "accounts.hpp"
+#include "capture.hpp"
+#include "crypto.hpp"
+#include "files.hpp"
+#include "hashes.hpp"
+#include "resolver.hpp"
+#include "search.hpp"
+#include "transfers.hpp"
+#include "users.hpp"
+
 using boost::asio::ip::tcp;
 using namespace boost::endian;
 
@@ -19,34 +29,91 @@ struct TrackerEntry final
 	std::string login, pw;
 };
 
+struct ServerConfig final
+{
+	uint16_t port = 5500;
+	size_t send_high_water = 1024*1024; // bytes queued for one client before we shed or drop it
+	unsigned threads = 0; // event loops to run, 0 for one per core
+	bool pin_threads = false; // pin each event loop to its own CPU
+	unsigned resolver_threads = 2;
+	size_t host_cache_size = 4096;
+	std::chrono::seconds host_cache_ttl = std::chrono::hours(1);
+	uint16_t metrics_port = 0; // serve Prometheus metrics on 127.0.0.1, 0 for none
+	std::string capture_path; // record client traffic here for hlreplay
+	std::string accounts_path = "accounts.db";
+	size_t account_cache_size = 4096;
+	unsigned crypto_threads = 2; // threads checking passwords
+	size_t crypto_queue = 256; // password checks waiting before logins are turned away
+	std::string files_path = "files"; // the root of what clients see
+	size_t file_list_cache_size = 1024; // folders whose listings are kept
+	unsigned index_threads = 2; // threads building the search index, 0 for no index
+	unsigned hash_threads = 2; // threads hashing files for XA_FILEHASH, 0 for no hashes
+	std::string hashes_path = "hashes.db";
+	bool hash_sweep = true; // hash everything in the background, not just what's asked for
+	unsigned transfer_threads = 2; // HTXF runs on port+1 with threads of its own
+	SyncPolicy upload_sync = SYNC_CLOSE;
+	uint64_t upload_sync_interval = 0; // bytes between syncs under SYNC_INTERVAL
+};
+
 class Server final
 {
 public:
-	Server(boost::asio::io_service&, const tcp::endpoint&);
+	Server(const ServerConfig&);
 	//~Server();
-	void Disconnect(class User*);
+	void Run();
+	void Disconnect(UserPtr);
 private:
-	std::map<uint16_t, class User*> users;
+	ServerConfig config;
+	HostResolver resolver;
+	AccountStore accounts;
+	CryptoPool crypto;
+	TransferServer transfers;
+	FileListCache file_list;
+	std::unique_ptr<FileIndex> index;
+	std::unique_ptr<HashPool> hashes;
+	UserTable users;
+	UserListCache user_list;
 	std::string name, description, agreement;
 	std::vector<TrackerEntry*> trackers;
 	boost::thread_group threads;
-	tcp::acceptor listener;
-	boost::asio::io_service &io;
-	sqlite3 *db;
-	SHA256_CTX *ctx;
-	big_uint16_t fake_users, last_user_id;
+	std::vector<std::unique_ptr<boost::asio::io_service>> loops;
+	std::vector<std::unique_ptr<boost::asio::io_service::work>> work;
+	std::vector<std::unique_ptr<tcp::acceptor>> listeners; // one per loop, sharded by SO_REUSEPORT
+	std::unique_ptr<tcp::acceptor> metrics_listener;
+	std::unique_ptr<Capture> capture;
+	big_uint16_t fake_users;
 	
-	void ReadTransaction(class User*);
-	void Listen();
-	void Resolve(class User*);
+	void ReadTransaction(UserPtr);
+	bool ParseTransactions(UserPtr);
+	bool HandleTransaction(UserPtr, class Transaction*);
+	void Listen(size_t);
+	void ServeMetrics();
+	void Resolve(UserPtr);
 	//void StartUser(UserPtr);
 	//void CheckUser(UserPtr);
-	void ValidateHello(class User*);
+	void ValidateHello(UserPtr);
 	void HandleLogin(class User*, class Transaction*);
+	void FinishLogin(UserPtr, uint32_t id, const std::string &login, std::shared_ptr<const Account>, bool ok);
 	void HandleAgreed(class User*, class Transaction*);
 	void HandleGetUserNameList(class User*);
 	void HandleGetUserInfo(class User*, class Transaction*);
+	void HandleSetUserInfo(class User*, class Transaction*);
 	void HandleSendChat(class User*, class Transaction*);
+	void HandleNewUser(class User*, class Transaction*);
+	void HandleDeleteUser(class User*, class Transaction*);
+	void HandleGetUser(class User*, class Transaction*);
+	void HandleSetUser(class User*, class Transaction*);
+	void HandleGetFileNameList(class User*, class Transaction*);
+	void HandleGetFileInfo(class User*, class Transaction*);
+	void HandleSearchFiles(class User*, class Transaction*);
+	void HandleIndexStatus(class User*, class Transaction*);
+	void HandleDownloadFile(class User*, class Transaction*);
+	void HandleDownloadFolder(class User*, class Transaction*);
+	void HandleUploadFile(class User*, class Transaction*);
+	void HandleUploadFolder(class User*, class Transaction*);
+	void SendError(class User*, const std::string&);
+	void SendError(class User*, const std::string&, uint32_t id);
+	void Broadcast(const class Transaction&);
 };
 
 Server const* GlobalInstance();
@@ -1,8 +1,26 @@
+#ifndef _TRANSACTIONS_H
+#define _TRANSACTIONS_H
+
 #include <algorithm>
+#include <array>
+#include <boost/asio/buffer.hpp>
+#include <boost/container/small_vector.hpp>
+#include <boost/endian/conversion.hpp>
 #include <cstring>
+#include <memory>
+#include <optional>
+#include <string_view>
 #include <vector>
 
 #include "globals.hpp"
+#include "pool.hpp"
+
+enum
+{
+	TRANSACTION_HEADER_SIZE = 20,
+	PAYLOAD_OFFSET = TRANSACTION_HEADER_SIZE+2, // past the parameter count
+	MAX_TRANSACTION_SIZE = 0x100000 // anything larger is a broken or hostile client
+};
 
 enum Opcode: uint16_t
 {
@@ -132,175 +150,134 @@ enum Field: uint16_t
 	F_NEWSARTFLAGS,
 	F_NEWSARTPARENTART,
 	F_NEWSART1STCHILDART,
-	F_NEWSARTRECURSEDEL
+	F_NEWSARTRECURSEDEL,
+	F_FILEHASHMD5 = 3712, // asked for empty in OP_GETFILEINFO, answered with the digest
+	F_FILEHASHSHA1
 };
 
-struct Parameter
+enum ParamKind: uint8_t
 {
-	big_uint16_t type;
-	
-	Parameter(uint16_t type): type(type) {}
-	
-	Parameter(std::istream &s)
-	{
-		s.read(reinterpret_cast<char*>(&type), 2);
-		boost::endian::big_to_native_inplace(type);
-	}
-	
-	virtual void Write(std::ostream&) const;
-	virtual uint16_t GetSize() const = 0;
-	virtual uint16_t AsInt16() const;
-	virtual uint32_t AsInt32() const;
-	virtual uint64_t AsInt64() const;
-	virtual std::string AsString() const;
-	virtual std::vector<uint8_t> AsByteArray() const;
-	virtual std::chrono::system_clock::time_point AsTime() const;
+	PK_UNKNOWN = 0,
+	PK_INTEGER,
+	PK_STRING,
+	PK_BYTES,
+	PK_TIME,
+	PK_USERINFO
 };
 
-struct Int16Param final: Parameter
-{
-	big_uint16_t ordinal;
-	
-	Int16Param(uint16_t t, uint16_t i): Parameter(t), ordinal(i) {}
-	
-	Int16Param(std::istream &s): Parameter(s)
-	{
-		s.ignore(2); // already know it's 2 bytes
-		s.read(reinterpret_cast<char*>(&ordinal), 2);
-	}
-	
-	void Write(std::ostream&) const;
-	uint16_t GetSize() const override;
-	uint16_t AsInt16() const override;
-};
+ParamKind FieldKind(uint16_t);
+uint16_t UserInfoSize(const class User*);
+void EncodeUserInfo(const class User*, uint8_t*);
 
-struct Int32Param final: Parameter
+// Fields live in a transaction's wire-encoded payload; this is just where to find one
+struct Parameter final
 {
-	big_uint32_t ordinal;
-	
-	Int32Param(uint16_t t, uint32_t i): Parameter(t), ordinal(i) {}
-	
-	Int32Param(std::istream &s): Parameter(s)
-	{
-		s.ignore(2); // already know it's 4 bytes
-		s.read(reinterpret_cast<char*>(&ordinal), 4);
-	}
-	
-	void Write(std::ostream&) const;
-	uint16_t GetSize() const override;
-	uint32_t AsInt32() const override;
+	uint16_t type, size;
+	uint32_t offset; // of the field data, relative to the payload
+	ParamKind kind;
 };
 
-struct Int64Param final: Parameter
+// Non-owning accessor for a single field, valid as long as its transaction's payload is
+struct ParamView final
 {
-	big_uint64_t ordinal;
+	uint16_t type, size;
+	ParamKind kind;
+	const uint8_t *data;
 	
-	Int64Param(uint16_t t, uint64_t i): Parameter(t), ordinal(i) {}
-	
-	Int64Param(std::istream &s): Parameter(s)
-	{
-		s.ignore(2); // already know it's 8 bytes
-		s.read(reinterpret_cast<char*>(&ordinal), 8);
-	}
-	
-	void Write(std::ostream&) const;
-	uint16_t GetSize() const override;
-	uint64_t AsInt64() const override;
+	uint16_t AsInt16() const;
+	uint32_t AsInt32() const;
+	uint64_t AsInt64() const;
+	std::string_view AsString() const; // the bytes as sent
+	std::string AsText() const; // with the client's CR line breaks made LF, for names and the like
+	std::chrono::system_clock::time_point AsTime() const;
 };
 
-struct StringParam final: Parameter
+// An encoded transaction on its way out. The payload is immutable and may be
+// shared by any number of frames, so only the header is per-recipient.
+struct Frame final
 {
-	std::string text;
+	uint8_t header[PAYLOAD_OFFSET];
+	std::shared_ptr<const std::vector<uint8_t>> payload;
 	
-	StringParam(uint16_t t, const char *s): Parameter(t), text(s) {}
-	
-	StringParam(std::istream &s): Parameter(s)
+	void SetID(uint32_t id)
 	{
-		big_uint16_t size;
-		s.read(reinterpret_cast<char*>(&size), 2);
-		text.resize(size);
-		s.read(&text[0], size);
+		boost::endian::store_big_u32(header+4, id);
 	}
 	
-	void Write(std::ostream&) const;
-	uint16_t GetSize() const override;
-	std::string AsString() const override;
-};
-
-struct ByteArrayParam final: Parameter
-{
-	std::vector<uint8_t> bytes;
-	
-	ByteArrayParam(uint16_t t, const uint8_t *b, uint16_t len): Parameter(t)
+	size_t Size() const
 	{
-		bytes.insert(bytes.begin(), b, b+len);
+		return PAYLOAD_OFFSET + (payload ? payload->size() : 0);
 	}
 	
-	ByteArrayParam(std::istream &s): Parameter(s)
+	std::array<boost::asio::const_buffer, 2> Buffers() const
 	{
-		big_uint16_t size;
-		s.read(reinterpret_cast<char*>(&size), 2);
-		bytes.resize(size);
-		s.read(reinterpret_cast<char*>(&bytes[0]), size);
+		using boost::asio::buffer;
+		
+		if (payload) return { buffer(header, PAYLOAD_OFFSET), buffer(*payload) };
+		return { buffer(header, PAYLOAD_OFFSET), boost::asio::const_buffer() };
 	}
-	
-	void Write(std::ostream&) const;
-	uint16_t GetSize() const override;
-	std::vector<uint8_t> AsByteArray() const override;
 };
 
-struct TimeParam final: Parameter
+struct Transaction final
 {
-	DateTime dt;
+	boost::container::small_vector<Parameter, 8> params;
+	boost::container::small_vector<uint8_t, 256> storage; // payload of transactions we build
+	const uint8_t *payload; // payload of received transactions, points into User::rx
+	uint32_t payload_size;
+	class User *user;
+	big_uint32_t id, error, size;
+	big_uint16_t type;
+	bool reply;
 	
-	TimeParam(uint16_t t, const std::chrono::system_clock::time_point &tp):
-		Parameter(t), dt(DateTime(tp)) {}
+	Transaction(class User *user, uint16_t type, bool reply, uint32_t id, uint32_t error = 0):
+		payload(nullptr), payload_size(0), user(user), id(id), error(error), type(type), reply(reply) {}
+	Transaction(class User*, const uint8_t *header);
 	
-	TimeParam(std::istream &s): Parameter(s), dt(DateTime(s))
+	// fields and their storage live inline, so the whole transaction is one pooled block
+	static void* operator new(size_t)
 	{
-		s.ignore(2); // timestamps are 8 bytes
+		return BlockPool<sizeof(Transaction)>::Allocate();
 	}
 	
-	void Write(std::ostream&) const;
-	uint16_t GetSize() const override;
-	std::chrono::system_clock::time_point AsTime() const override;
-};
-
-struct UserInfoParam final: Parameter
-{
-	char *name;
-	big_uint16_t id, icon, flags;
+	static void operator delete(void *p)
+	{
+		BlockPool<sizeof(Transaction)>::Release(p);
+	}
 	
-	UserInfoParam(class User*);
+	bool ReadParams(const uint8_t*, uint32_t);
+	std::optional<ParamView> Find(uint16_t) const;
+	uint32_t GetSize() const;
+	void Stamp(bool preserve_id);
+	void EncodeHeader(uint8_t*, uint32_t size, uint16_t nparams) const;
+	void Write(std::vector<uint8_t>&, bool preserve_id = false);
+	Frame Share() const;
+	Frame Encode(bool preserve_id = false);
+	Frame Wrap(const std::shared_ptr<const std::vector<uint8_t>>&, uint16_t nparams, bool preserve_id = false);
 	
-	~UserInfoParam()
+	ParamView operator[](size_t i) const
 	{
-		delete[] name;
+		const Parameter &p = params[i];
+		return ParamView { p.type, p.size, p.kind, Payload()+p.offset };
 	}
 	
-	void Write(std::ostream&) const;
-	uint16_t GetSize() const override;
-};
-
-struct Transaction final
-{
-	std::vector<Parameter*> params;
-	class User *user;
-	big_uint32_t id, error, size;
-	big_uint16_t type;
-	bool reply;
-	
-	Transaction(class User *user, uint16_t type, bool reply, uint32_t id, uint32_t error = 0):
-		user(user), type(type), reply(reply), id(id), error(error) {}
-	Transaction(class User*, std::istream&);
+	const uint8_t* Payload() const
+	{
+		return payload ? payload : storage.data();
+	}
 	
-	~Transaction()
+	uint32_t PayloadSize() const
 	{
-		for (auto p: params)
-			delete p;
+		return payload ? payload_size : storage.size();
 	}
 	
-	void ReadParams(std::istream&);
-	uint32_t GetSize() const;
-	void Write(std::ostream&, bool preserve_id = false);
+	uint8_t* AddField(uint16_t type, uint16_t size, ParamKind kind);
+	void AddInt16(uint16_t type, uint16_t);
+	void AddInt32(uint16_t type, uint32_t);
+	void AddInt64(uint16_t type, uint64_t);
+	void AddString(uint16_t type, std::string_view);
+	void AddBytes(uint16_t type, const uint8_t*, uint16_t);
+	void AddTime(uint16_t type, const std::chrono::system_clock::time_point&);
+	void AddUserInfo(const class User*);
 };
+
+#endif // _TRANSACTIONS_H
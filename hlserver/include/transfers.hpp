@@ -0,0 +1,228 @@
+#ifndef _TRANSFERS_H
+#define _TRANSFERS_H
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/thread.hpp>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <dirent.h>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include <unordered_map>
+#include <vector>
+
+#include "transactions.hpp"
+
+using boost::asio::ip::tcp;
+
+enum
+{
+	HTXF_HEADER_SIZE = 16, // 'HTXF', reference number, data size, reserved
+	FILE_HEADER_SIZE = 24, // 'FILP', version, reserved, fork count
+	FORK_HEADER_SIZE = 16, // fork type, compression, reserved, data size
+	INFO_FORK_SIZE = 74, // not counting the name and comment
+	RESUME_HEADER_SIZE = 42, // 'RFLT', version, reserved, fork count
+	TRANSFER_SLICE = 4*1024*1024, // bytes one transfer sends before letting the others have a go
+	UPLOAD_BUFFER_SIZE = 256*1024, // per upload, gathered into one write
+	UPLOAD_BUFFER_ALIGN = 4096,
+	READAHEAD_ITEMS = 16, // a folder download's files open ahead of the one being sent
+	READAHEAD_BYTES = 16*1024*1024, // and how much of them is being read in
+	FOLDER_BATCH = 256, // item headers sent before stopping to read the client's replies
+	FOLDER_COUNT_THREADS = 2 // walking folders to total them up for OP_DOWNLOADFLDR
+};
+
+// What a folder transfer's receiver tells the client to do with the item it just described
+enum FolderAction: uint16_t
+{
+	FLDR_SEND = 1,
+	FLDR_RESUME, // followed by the resume data
+	FLDR_NEXT // skip it, or go on to the next one
+};
+
+// When uploads are made durable. However it's set, a file only gets its real name once it's
+// all there.
+enum SyncPolicy: uint8_t
+{
+	SYNC_NONE = 0, // whenever the kernel gets around to it
+	SYNC_CLOSE, // once per file, before it's renamed into place
+	SYNC_INTERVAL // every so many bytes as well
+};
+
+static const std::chrono::seconds TRANSFER_TTL(60); // to connect and claim a reference number
+
+// A file on its way to a client: the flattened file object's headers, then the data fork from
+// offset on, straight from the page cache.
+struct Download final
+{
+	int fd;
+	uint64_t offset, size; // of the data fork still to send
+	std::vector<uint8_t> header;
+	
+	Download(int fd, uint64_t offset, uint64_t size, std::vector<uint8_t> &&header):
+		fd(fd), offset(offset), size(size), header(std::move(header)) {}
+	~Download();
+	Download(const Download&) = delete;
+	Download& operator=(const Download&) = delete;
+};
+
+// Something on its way from a client. It's written to name.hpf and only renamed when complete,
+// so an interrupted upload can be resumed from what's there.
+struct Upload final
+{
+	std::string dir; // for a folder upload, the folder itself
+	std::string name; // empty for a folder upload
+	uint64_t offset; // a single file's resume point
+	uint16_t items; // files and folders in a folder upload
+};
+
+// Depth first through a folder, with one open directory per level, so nothing is read before
+// it's needed. What's hidden from listings is left out here too.
+class FolderWalk final
+{
+public:
+	struct Item
+	{
+		std::string rel; // within the folder
+		bool folder;
+		struct stat st;
+	};
+	
+	explicit FolderWalk(const std::string &root);
+	~FolderWalk();
+	FolderWalk(const FolderWalk&) = delete;
+	FolderWalk& operator=(const FolderWalk&) = delete;
+	bool Next(Item&); // false once there's nothing left
+private:
+	std::vector<std::pair<DIR*, std::string>> open; // and where each is within the folder
+};
+
+// A folder on its way to a client, one item at a time. The walk stays only as far ahead of what's
+// being sent as the read-ahead needs.
+struct FolderDownload final
+{
+	struct Item
+	{
+		std::string rel;
+		bool folder;
+		std::unique_ptr<Download> file;
+	};
+	
+	std::string root;
+	std::unique_ptr<FolderWalk> walk;
+	std::deque<Item> ahead; // the file the client is deciding about first, then what's been opened after it
+	uint64_t ahead_bytes = 0;
+	unsigned replies = 0; // owed by the client for headers it's been sent
+	bool deciding = false; // the last of them was for ahead.front()
+	std::vector<uint8_t> in;
+	
+	explicit FolderDownload(const std::string &root): root(root) {}
+};
+
+// The headers of a flattened file object with just the info and data forks
+std::vector<uint8_t> FlattenFileHeader(std::string_view name, const std::chrono::system_clock::time_point &created,
+	const std::chrono::system_clock::time_point &modified, uint64_t data_size);
+// How much of the data fork a client already has, from F_FILERESUMEDATA, and the other way around
+bool ResumeOffset(const ParamView&, uint64_t &offset);
+std::vector<uint8_t> ResumeData(uint64_t offset);
+
+// HTXF, the file transfer protocol on port+1. A session asks for a transfer over the main
+// connection and gets a reference number; it then connects here and quotes it. Transfers run on
+// threads of their own, so however much is moving, chat doesn't wait on it.
+class TransferServer final
+{
+public:
+	TransferServer(uint16_t port, unsigned nthreads, SyncPolicy, uint64_t sync_interval);
+	~TransferServer();
+	// the reference number to send the client
+	uint32_t Offer(std::unique_ptr<Download>);
+	uint32_t Offer(std::unique_ptr<Upload>);
+	// counting what's in a folder means walking all of it, so that's done on threads of its own, where
+	// a big folder holds up nobody's transfer, and the reference number comes back to the callback,
+	// along with the size and item count
+	typedef std::function<void(uint32_t refnum, uint64_t size, uint32_t items)> FolderOffered;
+	void Offer(const std::string &folder, FolderOffered);
+private:
+	struct Ticket
+	{
+		std::unique_ptr<Download> download;
+		std::unique_ptr<Upload> upload;
+		std::unique_ptr<FolderDownload> folder;
+		std::unique_ptr<boost::asio::steady_timer> expiry;
+	};
+	
+	struct FreeDeleter
+	{
+		void operator()(uint8_t *p) const { free(p); }
+	};
+	
+	struct Connection
+	{
+		tcp::socket sock;
+		boost::asio::io_service::strand strand;
+		boost::asio::steady_timer timer;
+		uint8_t hello[HTXF_HEADER_SIZE];
+		std::unique_ptr<Download> download;
+		std::unique_ptr<Upload> upload;
+		std::unique_ptr<FolderDownload> folder;
+		
+		// the file an upload is writing
+		std::unique_ptr<uint8_t, FreeDeleter> buf;
+		size_t fill; // bytes in buf not yet written
+		std::vector<uint8_t> reply; // folder actions or item headers on their way out
+		std::string target;
+		int file;
+		uint64_t at, unsynced; // where the next write goes, and how much since the last sync
+		uint16_t forks;
+		bool writing; // the fork coming in is the data fork, the others are dropped
+		
+		Connection(boost::asio::io_service &io): sock(io), strand(io), timer(io), fill(0), file(-1) {}
+		~Connection();
+	};
+	
+	typedef std::function<void()> Next;
+	
+	boost::asio::io_service io;
+	std::unique_ptr<boost::asio::io_service::work> work;
+	tcp::acceptor listener;
+	boost::thread_group threads;
+	boost::asio::io_service counting;
+	std::unique_ptr<boost::asio::io_service::work> counting_work;
+	boost::thread_group counters;
+	std::mutex lock;
+	std::unordered_map<uint32_t, Ticket> tickets;
+	SyncPolicy sync;
+	uint64_t sync_interval;
+	
+	uint32_t Offer(Ticket&&);
+	Ticket Claim(uint32_t refnum);
+	void Listen();
+	void Start(std::shared_ptr<Connection>);
+	void SendFile(std::shared_ptr<Connection>, Download&, Next);
+	void Finish(std::shared_ptr<Connection>);
+	
+	void StartFolder(std::shared_ptr<Connection>);
+	void ReadAhead(FolderDownload&);
+	void Announce(std::shared_ptr<Connection>);
+	void Decide(std::shared_ptr<Connection>);
+	void SendItem(std::shared_ptr<Connection>, uint64_t offset);
+	
+	void StartUpload(std::shared_ptr<Connection>);
+	void NextItem(std::shared_ptr<Connection>);
+	void Act(std::shared_ptr<Connection>, FolderAction, uint64_t offset, Next);
+	void ReceiveFile(std::shared_ptr<Connection>, const std::string &target, uint64_t offset, Next);
+	void ReceiveForks(std::shared_ptr<Connection>, Next);
+	void Expect(std::shared_ptr<Connection>, size_t n, Next);
+	void Stream(std::shared_ptr<Connection>, uint64_t n, Next);
+	int WriteOut(Connection&);
+	bool Complete(Connection&);
+	void Abort(Connection&, const std::string &why);
+};
+
+#endif // _TRANSFERS_H
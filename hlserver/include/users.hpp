@@ -1,15 +1,21 @@
 #ifndef _USERS_H
 #define _USERS_H
 
+#include <atomic>
 #include <bitset>
 #include <boost/asio.hpp>
 #include <boost/endian/arithmetic.hpp>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <deque>
+#include <memory>
 #include <mutex>
 #include <openssl/sha.h>
 #include <utility>
+#include <vector>
+
+#include "transactions.hpp"
 
 using boost::asio::ip::tcp;
 using namespace boost::endian;
@@ -137,31 +143,52 @@ enum FolderAccess: uint8_t
 	FOLDER_ACCESS_BITS
 };
 
-struct User final
+enum SendPriority: uint8_t
+{
+	SP_NORMAL = 0,
+	SP_LOW // may be dropped when the client can't keep up
+};
+
+enum
+{
+	MAX_GATHER = 64, // frames coalesced into a single write
+	RX_BUFFER_SIZE = 16*1024 // per session, grown only for a transaction that won't fit
+};
+
+typedef std::shared_ptr<struct User> UserPtr;
+
+struct User final: std::enable_shared_from_this<User>
 {
 	std::string name, login, host, auto_reply;
+	std::vector<uint8_t> rx; // incoming transactions are decoded in place from here
+	size_t rx_start, rx_end; // the unparsed bytes in rx
 	uint8_t pw_sum[SHA256_DIGEST_LENGTH];
 	tcp::socket sock;
-	std::mutex lock;
+	tcp::endpoint remote; // taken at accept, as a closed socket can't say
+	boost::asio::io_service::strand strand; // serialises everything the session does
 	std::bitset<USER_ACCESS_BITS> access;
 	std::bitset<EXTRA_ACCESS_BITS> extra_access;
 	std::bitset<FOLDER_ACCESS_BITS> folder_access;
 	std::bitset<USER_FLAGS> flags;
+	std::deque<std::pair<Frame, SendPriority>> outbox;
+	std::vector<boost::asio::const_buffer> gather;
+	size_t queued_bytes, send_limit, in_flight;
+	uint64_t dropped;
 	big_uint32_t last_trans_id;
 	uint32_t nreplies;
+	uint32_t capture_id; // session number in the traffic capture, 0 if there isn't one
+	bool logged_in, verifying, close_when_flushed; // verifying: a login is with the crypto pool, reading waits
 	big_uint16_t id, icon, color, client_ver;
 	
 	User(boost::asio::io_service&);
 	~User();
 	void Disconnect();
+	void CloseWhenFlushed();
+	void Send(const Frame&, SendPriority prio = SP_NORMAL, bool stamp = false);
+	void Enqueue(Frame, SendPriority, bool stamp);
+	void Flush();
 	std::string InfoText() const;
 	
-	bool ComparePassword(const uint8_t *sum) const
-	{
-		return strncmp(reinterpret_cast<const char*>(pw_sum),
-			reinterpret_cast<const char*>(sum), SHA256_DIGEST_LENGTH) == 0 ? true : false;
-	}
-	
 	std::string PasswordSumString() const
 	{
 		std::string s(SHA256_DIGEST_LENGTH+1, 0);
@@ -177,4 +204,63 @@ struct User final
 	}
 };
 
+// Everyone connected, indexed by user ID. Find is one atomic shared_ptr load, and iteration walks
+// an immutable snapshot got the same way; libstdc++ does those loads under a small pool of
+// spinlocks held for the copy, so they're short, but they aren't lock-free. Joining and leaving
+// are O(1) and only mark the snapshot stale: the next Live() rebuilds it under the writers' lock,
+// so a crowd logging in between two broadcasts costs one copy, not one per login.
+class UserTable final
+{
+public:
+	typedef std::vector<UserPtr> Snapshot;
+	
+	UserTable();
+	uint16_t Add(UserPtr);
+	bool Remove(const UserPtr&);
+	std::shared_ptr<const Snapshot> Live();
+	size_t Count();
+	
+	UserPtr Find(uint16_t id) const
+	{
+		return std::atomic_load(&slots[id]);
+	}
+private:
+	std::mutex lock; // writers, and whoever rebuilds the snapshot
+	std::vector<UserPtr> slots;
+	std::vector<UserPtr> members; // in no particular order
+	std::vector<uint16_t> where; // each ID's place in members
+	std::shared_ptr<const Snapshot> live;
+	std::atomic<bool> stale;
+	std::deque<uint16_t> free_ids; // recycled oldest first
+	uint32_t next_id;
+};
+
+// The OP_GETUSERNAMELIST reply fields, kept encoded and patched as people come, go and change
+class UserListCache final
+{
+public:
+	struct Listing
+	{
+		std::shared_ptr<const std::vector<uint8_t>> fields;
+		uint16_t count;
+	};
+	
+	void Update(const User*);
+	void Remove(uint16_t id);
+	Listing List(bool with_hidden);
+private:
+	struct Variant
+	{
+		std::vector<uint8_t> fields; // F_USERNAMEWITHINFO records, in join order
+		uint16_t count = 0;
+		Listing published { std::make_shared<const std::vector<uint8_t>>(), 0 };
+		bool dirty = false;
+		
+		void Patch(uint16_t id, const uint8_t *rec, size_t len);
+	};
+	
+	std::mutex lock;
+	Variant everyone, visible;
+};
+
 #endif // _USERS_H
@@ -0,0 +1,267 @@
+#include <cstring>
+#include <iostream>
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
+#include <stdexcept>
+
+#include "accounts.hpp"
+#include "globals.hpp"
+
+bool Account::CheckPassword(const std::string &password, EVP_MD_CTX *ctx) const
+{
+	uint8_t sum[SHA256_DIGEST_LENGTH];
+	if (!EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr) || !EVP_DigestUpdate(ctx, password.data(), password.size()) ||
+		!EVP_DigestFinal_ex(ctx, sum, nullptr))
+		return false;
+	return CRYPTO_memcmp(sum, pw_sum, sizeof(sum)) == 0;
+}
+
+void Account::SetPassword(const std::string &password)
+{
+	SHA256(reinterpret_cast<const uint8_t*>(password.data()), password.size(), pw_sum);
+}
+
+std::bitset<USER_ACCESS_BITS> AccessFromWire(uint64_t wire)
+{
+	std::bitset<USER_ACCESS_BITS> access;
+	for (size_t i = 0; i < USER_ACCESS_BITS; i++) access[i] = (wire >> (63-i)) & 1;
+	return access;
+}
+
+uint64_t AccessToWire(const std::bitset<USER_ACCESS_BITS> &access)
+{
+	uint64_t wire = 0;
+	for (size_t i = 0; i < USER_ACCESS_BITS; i++)
+		if (access[i]) wire |= uint64_t(1) << (63-i);
+	return wire;
+}
+
+AccountStore::AccountStore(const std::string &path, size_t cache_size):
+	db(nullptr),
+	select(nullptr),
+	insert(nullptr),
+	update(nullptr),
+	erase(nullptr),
+	generation(0),
+	cache_size(cache_size)
+{
+	// our own lock serialises access, SQLite needn't bother
+	if (sqlite3_open_v2(path.c_str(), &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX,
+		nullptr) != SQLITE_OK)
+	{
+		std::string err = db ? sqlite3_errmsg(db) : "out of memory";
+		sqlite3_close(db);
+		throw std::runtime_error("Can't open account database " + path + ": " + err);
+	}
+	
+	try
+	{
+		// readers don't block the odd writer and vice versa, and a commit needn't wait on fsync
+		Exec("PRAGMA journal_mode=WAL");
+		Exec("PRAGMA synchronous=NORMAL");
+		Exec("CREATE TABLE IF NOT EXISTS accounts ("
+			"login TEXT PRIMARY KEY NOT NULL, "
+			"name TEXT NOT NULL DEFAULT '', "
+			"password BLOB NOT NULL, "
+			"access INTEGER NOT NULL DEFAULT 0)");
+		
+		select = Prepare("SELECT name, password, access FROM accounts WHERE login = ?1");
+		insert = Prepare("INSERT OR IGNORE INTO accounts (login, name, password, access) VALUES (?1, ?2, ?3, ?4)");
+		update = Prepare("UPDATE accounts SET name = ?2, password = ?3, access = ?4 WHERE login = ?1");
+		erase = Prepare("DELETE FROM accounts WHERE login = ?1");
+		
+		Bootstrap();
+	}
+	catch (...)
+	{
+		Close();
+		throw;
+	}
+}
+
+AccountStore::~AccountStore()
+{
+	Close();
+}
+
+void AccountStore::Close()
+{
+	for (auto s: { select, insert, update, erase }) sqlite3_finalize(s);
+	sqlite3_close(db);
+}
+
+void AccountStore::Exec(const char *sql)
+{
+	char *err = nullptr;
+	if (sqlite3_exec(db, sql, nullptr, nullptr, &err) != SQLITE_OK)
+	{
+		std::string msg = err ? err : sqlite3_errmsg(db);
+		sqlite3_free(err);
+		throw std::runtime_error("[Accounts]: " + msg);
+	}
+}
+
+sqlite3_stmt* AccountStore::Prepare(const char *sql)
+{
+	sqlite3_stmt *s = nullptr;
+	if (sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &s, nullptr) != SQLITE_OK)
+		throw std::runtime_error(std::string("[Accounts]: ") + sqlite3_errmsg(db));
+	return s;
+}
+
+void AccountStore::Bind(sqlite3_stmt *s, const Account &a)
+{
+	sqlite3_bind_text(s, 1, a.login.data(), a.login.size(), SQLITE_TRANSIENT);
+	sqlite3_bind_text(s, 2, a.name.data(), a.name.size(), SQLITE_TRANSIENT);
+	sqlite3_bind_blob(s, 3, a.pw_sum, sizeof(a.pw_sum), SQLITE_TRANSIENT);
+	sqlite3_bind_int64(s, 4, static_cast<sqlite3_int64>(AccessToWire(a.access)));
+}
+
+bool AccountStore::Step(sqlite3_stmt *s)
+{
+	// statements are kept for reuse, so put them back the way they were whatever happens
+	int rc = sqlite3_step(s);
+	bool changed = rc == SQLITE_DONE && sqlite3_changes(db) > 0;
+	
+	if (rc != SQLITE_DONE) Log(LL_ERROR, std::string("[Accounts]: ") + sqlite3_errmsg(db));
+	sqlite3_reset(s);
+	sqlite3_clear_bindings(s);
+	return changed;
+}
+
+void AccountStore::Bootstrap()
+{
+	// a brand new database gets a guest account with the access everybody had before there were
+	// accounts, and an administrator to hand out the rest
+	Account guest;
+	guest.login = "guest";
+	guest.name = "Guest";
+	guest.SetPassword("");
+	guest.access = AccessFromWire(GUEST_ACCESS);
+	
+	Bind(insert, guest);
+	if (Step(insert)) Log("Created the guest account");
+	
+	if (Find("admin")) return;
+	
+	uint8_t random[12];
+	if (RAND_bytes(random, sizeof(random)) != 1) throw std::runtime_error("[Accounts]: No randomness for a password");
+	
+	std::string password;
+	for (uint8_t b: random) password += "abcdefghijkmnpqrstuvwxyz23456789"[b % 32];
+	
+	Account admin;
+	admin.login = "admin";
+	admin.name = "Administrator";
+	admin.SetPassword(password);
+	admin.access = AccessFromWire(ADMIN_ACCESS);
+	
+	if (!Create(admin)) return;
+	
+	// the log is kept and rotated, so the password only goes to whoever started the server
+	std::cerr << "Created account admin with password " << password << ", change it\n";
+	Log(LL_WARNING, "Created account admin, its password is on stderr");
+}
+
+std::shared_ptr<const Account> AccountStore::Find(const std::string &login)
+{
+	uint64_t gen;
+	{
+		std::lock_guard<std::mutex> guard(cache_lock);
+		auto it = cache.find(login);
+		if (it != cache.end())
+		{
+			lru.splice(lru.begin(), lru, it->second.lru);
+			return it->second.account;
+		}
+		gen = generation;
+	}
+	
+	std::shared_ptr<Account> a;
+	{
+		std::lock_guard<std::mutex> guard(db_lock);
+		
+		sqlite3_bind_text(select, 1, login.data(), login.size(), SQLITE_TRANSIENT);
+		int rc = sqlite3_step(select);
+		if (rc == SQLITE_ROW && sqlite3_column_bytes(select, 1) == SHA256_DIGEST_LENGTH)
+		{
+			a = std::make_shared<Account>();
+			a->login = login;
+			a->name = reinterpret_cast<const char*>(sqlite3_column_text(select, 0));
+			std::memcpy(a->pw_sum, sqlite3_column_blob(select, 1), SHA256_DIGEST_LENGTH);
+			a->access = AccessFromWire(static_cast<uint64_t>(sqlite3_column_int64(select, 2)));
+		}
+		else if (rc != SQLITE_ROW && rc != SQLITE_DONE)
+			Log(LL_ERROR, std::string("[Accounts]: ") + sqlite3_errmsg(db));
+		
+		sqlite3_reset(select);
+		sqlite3_clear_bindings(select);
+	}
+	
+	// a login that doesn't exist is one query each time, same as it always was
+	std::lock_guard<std::mutex> guard(cache_lock);
+	if (a && gen == generation && cache_size && !cache.count(login))
+	{
+		if (cache.size() >= cache_size)
+		{
+			cache.erase(lru.back());
+			lru.pop_back();
+		}
+		
+		lru.push_front(login);
+		cache.emplace(login, Cached { a, lru.begin() });
+	}
+	
+	return a;
+}
+
+bool AccountStore::Create(const Account &a)
+{
+	bool done;
+	{
+		std::lock_guard<std::mutex> guard(db_lock);
+		Bind(insert, a);
+		done = Step(insert);
+	}
+	
+	Invalidate(a.login);
+	return done;
+}
+
+bool AccountStore::Update(const Account &a)
+{
+	bool done;
+	{
+		std::lock_guard<std::mutex> guard(db_lock);
+		Bind(update, a);
+		done = Step(update);
+	}
+	
+	Invalidate(a.login);
+	return done;
+}
+
+bool AccountStore::Remove(const std::string &login)
+{
+	bool done;
+	{
+		std::lock_guard<std::mutex> guard(db_lock);
+		sqlite3_bind_text(erase, 1, login.data(), login.size(), SQLITE_TRANSIENT);
+		done = Step(erase);
+	}
+	
+	Invalidate(login);
+	return done;
+}
+
+void AccountStore::Invalidate(const std::string &login)
+{
+	std::lock_guard<std::mutex> guard(cache_lock);
+	auto it = cache.find(login);
+	if (it != cache.end())
+	{
+		lru.erase(it->second.lru);
+		cache.erase(it);
+	}
+	++generation;
+}
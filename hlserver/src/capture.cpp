@@ -0,0 +1,119 @@
+#include <boost/endian/conversion.hpp>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <unistd.h>
+
+#include "capture.hpp"
+#include "log.hpp"
+
+Capture::Capture(const std::string &path):
+	dropped(0),
+	stop(false),
+	start(std::chrono::steady_clock::now()),
+	next_session(0)
+{
+	// passwords and all go in here, so only we get to read it, and an old capture is never written over
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	out = fd >= 0 ? fdopen(fd, "wb") : nullptr;
+	if (!out)
+	{
+		std::string err = strerror(errno);
+		if (fd >= 0) close(fd);
+		throw std::runtime_error("Can't create capture file " + path + ": " + err);
+	}
+	
+	uint8_t header[CAPTURE_HEADER_SIZE];
+	std::memcpy(header, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+	boost::endian::store_big_u64(header+8, std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count());
+	fwrite(header, 1, sizeof(header), out);
+	
+	writer = std::thread([this]() { Run(); });
+	Log("Capturing client traffic to " + path);
+}
+
+Capture::~Capture()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stop = true;
+		wake.notify_one();
+	}
+	writer.join();
+	fclose(out);
+}
+
+uint32_t Capture::Open()
+{
+	uint32_t session = ++next_session;
+	Append(CR_OPEN, session, nullptr, 0);
+	return session;
+}
+
+void Capture::Data(uint32_t session, const uint8_t *data, uint32_t len)
+{
+	Append(CR_DATA, session, data, len);
+}
+
+void Capture::Close(uint32_t session)
+{
+	Append(CR_CLOSE, session, nullptr, 0);
+}
+
+void Capture::Append(CaptureRecord kind, uint32_t session, const uint8_t *data, uint32_t len)
+{
+	uint8_t header[CAPTURE_RECORD_SIZE];
+	header[0] = kind;
+	boost::endian::store_big_u32(header+1, session);
+	boost::endian::store_big_u64(header+5, std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now()-start).count());
+	boost::endian::store_big_u32(header+13, len);
+	
+	std::lock_guard<std::mutex> guard(lock);
+	
+	// never let a slow disk grow the server without bound, a gap in the capture is better
+	if (backlog.size()+sizeof(header)+len > MAX_CAPTURE_BACKLOG)
+	{
+		++dropped;
+		return;
+	}
+	
+	backlog.insert(backlog.end(), header, header+sizeof(header));
+	if (len) backlog.insert(backlog.end(), data, data+len);
+}
+
+void Capture::Run()
+{
+	std::vector<uint8_t> batch;
+	uint64_t reported = 0;
+	
+	for (;;)
+	{
+		bool done;
+		uint64_t d;
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			if (!stop) wake.wait_for(guard, std::chrono::milliseconds(100));
+			batch.swap(backlog);
+			done = stop;
+			d = dropped;
+		}
+		
+		if (!batch.empty())
+		{
+			fwrite(batch.data(), 1, batch.size(), out);
+			fflush(out);
+			batch.clear();
+		}
+		
+		if (d != reported)
+		{
+			Log(LL_WARNING, "Capture: " + std::to_string(d-reported) + " record(s) dropped, the disk can't keep up");
+			reported = d;
+		}
+		
+		if (done) break;
+	}
+}
@@ -0,0 +1,52 @@
+#include <openssl/evp.h>
+#include <stdexcept>
+
+#include "crypto.hpp"
+
+// every worker hashes with a context of its own
+static thread_local EVP_MD_CTX *ctx = nullptr;
+
+CryptoPool::CryptoPool(unsigned nthreads, size_t max_queue):
+	work(new boost::asio::io_service::work(io)),
+	queued(0),
+	max_queue(max_queue)
+{
+	for (unsigned i = 0; i < std::max(1u, nthreads); i++)
+		threads.create_thread(
+			[this]()
+			{
+				ctx = EVP_MD_CTX_new();
+				if (!ctx) throw std::runtime_error("[Crypto]: Out of memory");
+				io.run();
+				EVP_MD_CTX_free(ctx);
+			});
+}
+
+CryptoPool::~CryptoPool()
+{
+	work.reset();
+	io.stop();
+	threads.join_all();
+}
+
+bool CryptoPool::Verify(std::shared_ptr<const Account> account, std::string password, Callback cb)
+{
+	if (queued.fetch_add(1, std::memory_order_relaxed) >= max_queue)
+	{
+		queued.fetch_sub(1, std::memory_order_relaxed);
+		return false;
+	}
+	
+	boost::asio::post(io,
+		[this, account, password, cb]()
+		{
+			// a login that doesn't exist costs as much as a wrong password, so timing doesn't tell them apart
+			static const Account nobody {};
+			bool ok = (account ? *account : nobody).CheckPassword(password, ctx) && account;
+			
+			queued.fetch_sub(1, std::memory_order_relaxed);
+			cb(ok);
+		});
+	
+	return true;
+}
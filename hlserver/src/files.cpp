@@ -0,0 +1,590 @@
+#include <algorithm>
+#include <boost/endian/conversion.hpp>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <poll.h>
+#include <strings.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "files.hpp"
+
+enum
+{
+	FILE_RECORD_SIZE = 24, // field header, type, creator, size, reserved, script, name length
+	WATCH_EVENTS = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE |
+		IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR
+};
+
+bool ValidFileName(std::string_view name)
+{
+	return !name.empty() && name != "." && name != ".." && name.find_first_of(std::string_view("/\0", 2)) == std::string_view::npos;
+}
+
+bool DecodeFilePath(const std::optional<ParamView> &path, std::string &rel)
+{
+	rel.clear();
+	if (!path || path->size == 0) return true;
+	if (path->size < 2) return false;
+	
+	const uint8_t *p = path->data, *end = path->data+path->size;
+	uint16_t count = boost::endian::load_big_u16(p);
+	p += 2;
+	
+	for (uint16_t i = 0; i < count; i++)
+	{
+		if (end-p < 3 || end-p-3 < p[2]) return false;
+		
+		std::string_view name(reinterpret_cast<const char*>(p+3), p[2]);
+		if (!ValidFileName(name)) return false;
+		
+		rel = JoinPath(rel, name);
+		p += 3+p[2];
+	}
+	
+	return true;
+}
+
+void EncodeFilePath(std::vector<uint8_t> &out, std::string_view rel)
+{
+	size_t at = out.size();
+	uint16_t count = 0;
+	out.resize(at+2);
+	
+	while (!rel.empty())
+	{
+		size_t slash = rel.find('/');
+		std::string_view name = rel.substr(0, std::min<size_t>(slash, UINT8_MAX));
+		
+		out.insert(out.end(), { 0, 0, uint8_t(name.size()) });
+		out.insert(out.end(), name.begin(), name.end());
+		count++;
+		
+		rel.remove_prefix(slash == std::string_view::npos ? rel.size() : slash+1);
+	}
+	
+	boost::endian::store_big_u16(out.data()+at, count);
+}
+
+void FileTypeCodes(std::string_view name, char type[4], char creator[4])
+{
+	static const struct { const char *ext, *type, *creator; } codes[] =
+	{
+		{ "txt", "TEXT", "ttxt" },
+		{ "jpg", "JPEG", "ogle" },
+		{ "jpeg", "JPEG", "ogle" },
+		{ "gif", "GIFf", "ogle" },
+		{ "png", "PNGf", "ogle" },
+		{ "zip", "ZIP ", "SITx" },
+		{ "sit", "SIT!", "SITx" },
+		{ "mp3", "MP3 ", "TVOD" },
+		{ "pdf", "PDF ", "CARO" }
+	};
+	
+	std::memcpy(type, "BINA", 4);
+	std::memcpy(creator, "dosa", 4);
+	
+	size_t dot = name.rfind('.');
+	if (dot == std::string_view::npos) return;
+	
+	std::string ext(name.substr(dot+1));
+	std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return std::tolower(c); });
+	
+	for (auto &c: codes)
+	{
+		if (ext == c.ext)
+		{
+			std::memcpy(type, c.type, 4);
+			std::memcpy(creator, c.creator, 4);
+			return;
+		}
+	}
+}
+
+bool HiddenFile(std::string_view name)
+{
+	return name.empty() || name[0] == '.' || (name.size() > 4 && name.substr(name.size()-4) == ".hpf");
+}
+
+void EncodeFileRecord(std::vector<uint8_t> &out, std::string_view name, const char type[4], const char creator[4], uint32_t size)
+{
+	using namespace boost::endian;
+	
+	size_t at = out.size();
+	out.resize(at+FILE_RECORD_SIZE+name.size(), 0);
+	uint8_t *rec = &out[at];
+	
+	store_big_u16(rec, F_FILENAMEWITHINFO);
+	store_big_u16(rec+2, FILE_RECORD_SIZE-4+name.size());
+	std::memcpy(rec+4, type, 4);
+	std::memcpy(rec+8, creator, 4);
+	store_big_u32(rec+12, size);
+	store_big_u16(rec+22, name.size());
+	std::memcpy(rec+FILE_RECORD_SIZE, name.data(), name.size());
+}
+
+// case doesn't matter, unless that's all that tells two names apart
+static bool NameLess(std::string_view a, std::string_view b)
+{
+	int c = strncasecmp(a.data(), b.data(), std::min(a.size(), b.size()));
+	if (c) return c < 0;
+	if (a.size() != b.size()) return a.size() < b.size();
+	return a < b;
+}
+
+static std::string_view RecordName(const uint8_t *rec)
+{
+	return std::string_view(reinterpret_cast<const char*>(rec+FILE_RECORD_SIZE), boost::endian::load_big_u16(rec+22));
+}
+
+static size_t RecordSize(const uint8_t *rec)
+{
+	return boost::endian::load_big_u16(rec+2)+4;
+}
+
+static bool FolderRecord(const std::vector<uint8_t> &rec)
+{
+	return std::memcmp(&rec[4], "fldr", 4) == 0;
+}
+
+// What a listing shows: files and folders, links followed, nothing hidden. The type readdir gives
+// is enough for anything but links, so counting a folder's items doesn't stat every one of them.
+static bool Listable(DIR *d, const dirent *e)
+{
+	if (HiddenFile(e->d_name)) return false;
+	if (e->d_type == DT_REG || e->d_type == DT_DIR) return true;
+	if (e->d_type != DT_LNK && e->d_type != DT_UNKNOWN) return false;
+	
+	struct stat st;
+	return fstatat(dirfd(d), e->d_name, &st, 0) == 0 && (S_ISREG(st.st_mode) || S_ISDIR(st.st_mode));
+}
+
+// the same items a listing of the folder would have
+static uint32_t CountItems(const std::string &path)
+{
+	DIR *d = opendir(path.c_str());
+	if (!d) return 0;
+	
+	uint32_t n = 0;
+	while (dirent *e = readdir(d))
+		if (n < UINT16_MAX && Listable(d, e)) n++;
+	
+	closedir(d);
+	return n;
+}
+
+void FileListCache::Folder::Patch(std::string_view name, const std::vector<uint8_t> *rec)
+{
+	size_t at = 0;
+	
+	// the same hop over the records as the user list, which keeps them in order for free
+	while (at < fields.size() && NameLess(RecordName(&fields[at]), name))
+		at += RecordSize(&fields[at]);
+	
+	if (at < fields.size() && RecordName(&fields[at]) == name)
+	{
+		size_t old = RecordSize(&fields[at]);
+		
+		if (rec && rec->size() == old)
+			std::copy(rec->begin(), rec->end(), fields.begin()+at);
+		else
+		{
+			fields.erase(fields.begin()+at, fields.begin()+at+old);
+			if (rec)
+				fields.insert(fields.begin()+at, rec->begin(), rec->end());
+			else
+				--count;
+		}
+	}
+	else if (rec && count < UINT16_MAX)
+	{
+		fields.insert(fields.begin()+at, rec->begin(), rec->end());
+		++count;
+	}
+	else
+		return;
+	
+	dirty = true;
+}
+
+void FileListCache::Folder::SetSize(std::string_view name, uint32_t size)
+{
+	using namespace boost::endian;
+	
+	for (size_t at = 0; at < fields.size(); at += RecordSize(&fields[at]))
+	{
+		if (RecordName(&fields[at]) == name)
+		{
+			if (load_big_u32(&fields[at+12]) == size) return;
+			store_big_u32(&fields[at+12], size);
+			dirty = true;
+			return;
+		}
+	}
+}
+
+FileListCache::FileListCache(const std::string &root, size_t capacity):
+	root(root),
+	capacity(capacity),
+	inotify(inotify_init1(IN_CLOEXEC)),
+	stop(eventfd(0, EFD_CLOEXEC)),
+	reading_work(new boost::asio::io_service::work(reading))
+{
+	for (unsigned i = 0; i < FILE_LIST_THREADS; i++)
+		readers.create_thread([this]() { reading.run(); });
+	
+	if (inotify < 0 || stop < 0)
+	{
+		Log(LL_WARNING, std::string("No inotify, file listings won't be cached: ") + strerror(errno));
+		return;
+	}
+	
+	watcher = std::thread([this]() { Run(); });
+}
+
+FileListCache::~FileListCache()
+{
+	// whoever is still waiting on a folder goes unanswered, as the server's on its way down
+	reading_work.reset();
+	reading.stop();
+	readers.join_all();
+	
+	if (watcher.joinable())
+	{
+		uint64_t one = 1;
+		if (write(stop, &one, sizeof(one)) == sizeof(one)) watcher.join();
+		else watcher.detach();
+	}
+	
+	if (inotify >= 0) close(inotify);
+	if (stop >= 0) close(stop);
+}
+
+void FileListCache::List(const std::string &rel, Listed done)
+{
+	Listing out;
+	
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		
+		auto it = folders.find(rel);
+		if (it == folders.end())
+		{
+			// if someone else is reading it already, their listing will do
+			auto b = building.emplace(rel, Reading());
+			b.first->second.waiting.push_back(std::move(done));
+			if (b.second) boost::asio::post(reading, [this, rel]() { Read(rel); });
+			return;
+		}
+		
+		Folder &f = it->second;
+		lru.splice(lru.begin(), lru, f.lru);
+		
+		// frames already queued hold on to the old copy, so publish a new one rather than touching it
+		if (f.dirty)
+		{
+			f.published = Listing { std::make_shared<const std::vector<uint8_t>>(f.fields), f.count };
+			f.dirty = false;
+		}
+		
+		out = f.published;
+	}
+	
+	done(true, out);
+}
+
+void FileListCache::Read(const std::string &rel)
+{
+	// watch first, so nothing that happens while the folder is being read goes unnoticed
+	int wd;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		wd = AddWatch(rel);
+	}
+	
+	// a listing that won't be kept needn't watch its subfolders either
+	Folder f;
+	Listing out;
+	bool ok = Build(rel, f, wd >= 0);
+	if (ok) out = f.published = Listing { std::make_shared<const std::vector<uint8_t>>(f.fields), f.count };
+	
+	std::vector<Listed> waiting;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		
+		auto b = building.find(rel);
+		bool changed = b->second.changed;
+		waiting.swap(b->second.waiting);
+		building.erase(b);
+		
+		// a subfolder whose item count can't be kept right is as good as a change
+		bool untracked = std::any_of(f.counted.begin(), f.counted.end(),
+			[](const std::pair<const std::string, int> &c) { return c.second < 0; });
+		
+		if (!ok || changed || untracked || wd < 0)
+		{
+			Release(wd);
+			for (auto &c: f.counted) Release(c.second);
+		}
+		else
+		{
+			f.wd = wd;
+			lru.push_front(rel);
+			f.lru = lru.begin();
+			folders.emplace(rel, std::move(f));
+			
+			while (folders.size() > capacity) Drop(lru.back(), false);
+		}
+	}
+	
+	// a change made while it was being read isn't in it, but it's as fresh as
+	// what anyone who asked a moment earlier would have got
+	for (auto &w: waiting) w(ok, out);
+}
+
+bool FileListCache::Build(const std::string &rel, Folder &f, bool watch)
+{
+	DIR *d = opendir(JoinPath(root, rel).c_str());
+	if (!d) return false;
+	
+	std::vector<std::string> names;
+	while (dirent *e = readdir(d))
+		if (Listable(d, e)) names.emplace_back(e->d_name);
+	closedir(d);
+	
+	std::sort(names.begin(), names.end(), NameLess);
+	
+	std::vector<uint8_t> rec;
+	for (auto &name: names)
+	{
+		int wd = -1;
+		if (f.count == UINT16_MAX) break;
+		if (!Describe(rel, name, rec, watch ? &wd : nullptr)) continue;
+		
+		f.fields.insert(f.fields.end(), rec.begin(), rec.end());
+		++f.count;
+		if (watch && FolderRecord(rec)) f.counted.emplace(name, wd);
+	}
+	
+	return true;
+}
+
+// A folder's size is how many items are in it. Given wd, a folder is watched before it's counted,
+// so whatever happens to it afterwards is heard about.
+bool FileListCache::Describe(const std::string &rel, std::string_view name, std::vector<uint8_t> &rec, int *wd)
+{
+	std::string sub = JoinPath(rel, name), path = JoinPath(root, sub);
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0 || !(S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))) return false;
+	
+	rec.clear();
+	if (S_ISDIR(st.st_mode))
+	{
+		if (wd)
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			*wd = AddWatch(sub);
+		}
+		EncodeFileRecord(rec, name, "fldr", "\0\0\0\0", CountItems(path));
+	}
+	else
+	{
+		char type[4] = {}, creator[4] = {};
+		FileTypeCodes(name, type, creator);
+		EncodeFileRecord(rec, name, type, creator, std::min<uint64_t>(st.st_size, UINT32_MAX));
+	}
+	
+	return true;
+}
+
+// A folder's listing and its parent's share the one watch on it, so it goes once neither needs it.
+// Called with the lock held.
+int FileListCache::AddWatch(const std::string &rel)
+{
+	if (!watcher.joinable()) return -1;
+	
+	int wd = inotify_add_watch(inotify, JoinPath(root, rel).c_str(), WATCH_EVENTS);
+	if (wd < 0) return -1;
+	
+	// the same folder by another name, leave it be
+	auto w = watches.emplace(wd, Watch { rel, 0 }).first;
+	if (w->second.rel != rel) return -1;
+	
+	++w->second.uses;
+	return wd;
+}
+
+void FileListCache::Release(int wd)
+{
+	auto w = watches.find(wd);
+	if (w == watches.end() || --w->second.uses) return;
+	
+	watches.erase(w);
+	inotify_rm_watch(inotify, wd);
+}
+
+void FileListCache::Drop(const std::string &rel, bool below)
+{
+	auto inside = [&](const std::string &p)
+	{
+		return p == rel || (below && (rel.empty() || (p.size() > rel.size() && p[rel.size()] == '/' && p.compare(0, rel.size(), rel) == 0)));
+	};
+	
+	for (auto &b: building)
+		if (inside(b.first)) b.second.changed = true;
+	
+	for (auto it = folders.begin(); it != folders.end();)
+	{
+		if (!inside(it->first))
+		{
+			++it;
+			continue;
+		}
+		
+		Release(it->second.wd);
+		for (auto &c: it->second.counted) Release(c.second);
+		lru.erase(it->second.lru);
+		it = folders.erase(it);
+	}
+}
+
+void FileListCache::Run()
+{
+	alignas(inotify_event) char buf[64*1024];
+	pollfd fds[2] = { { inotify, POLLIN, 0 }, { stop, POLLIN, 0 } };
+	
+	for (;;)
+	{
+		if (poll(fds, 2, -1) < 0)
+		{
+			if (errno == EINTR) continue;
+			Log(LL_ERROR, std::string("File list watcher: ") + strerror(errno));
+			return;
+		}
+		if (fds[1].revents) return;
+		
+		ssize_t n = read(inotify, buf, sizeof(buf));
+		for (char *p = buf; n > 0 && p < buf+n;)
+		{
+			auto ev = reinterpret_cast<const inotify_event*>(p);
+			Handle(ev->wd, ev->mask, ev->len ? std::string(ev->name) : std::string());
+			p += sizeof(inotify_event)+ev->len;
+		}
+	}
+}
+
+void FileListCache::Handle(int wd, uint32_t mask, const std::string &name)
+{
+	std::string rel, up, base;
+	bool listed;
+	
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		
+		// we missed something, so nothing can be trusted
+		if (mask & IN_Q_OVERFLOW)
+		{
+			Drop("", true);
+			return;
+		}
+		
+		auto w = watches.find(wd);
+		if (w == watches.end()) return;
+		rel = w->second.rel;
+		
+		size_t slash = rel.rfind('/');
+		up = slash == std::string::npos ? std::string() : rel.substr(0, slash);
+		base = slash == std::string::npos ? rel : rel.substr(slash+1);
+		
+		// the folder, or the one it's a subfolder of, will have to be read again
+		for (auto &r: { rel, up })
+		{
+			auto b = building.find(r);
+			if (b != building.end()) b->second.changed = true;
+		}
+		
+		if (mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+		{
+			Drop(rel, true);
+			return;
+		}
+		if (HiddenFile(name)) return;
+		
+		// whatever was cached under a folder that's gone or moved is filed under the wrong name now
+		if ((mask & IN_ISDIR) && (mask & (IN_DELETE | IN_MOVED_FROM))) Drop(JoinPath(rel, name), true);
+		
+		// a folder that's only watched for its parent's sake only cares about how many items it has
+		listed = folders.count(rel);
+		if (!listed)
+		{
+			auto parent = rel.empty() ? folders.end() : folders.find(up);
+			if (parent == folders.end() || !(mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))) return;
+			
+			auto c = parent->second.counted.find(base);
+			if (c == parent->second.counted.end() || c->second != wd) return;
+		}
+	}
+	
+	// the disk is read without the lock, so listings elsewhere don't wait on it
+	std::vector<uint8_t> rec;
+	int sub = -1;
+	bool found = false;
+	uint32_t items = 0;
+	
+	if (!listed)
+		items = CountItems(JoinPath(root, rel));
+	else if (!(mask & (IN_DELETE | IN_MOVED_FROM)))
+		found = Describe(rel, name, rec, &sub);
+	
+	std::lock_guard<std::mutex> guard(lock);
+	
+	auto it = folders.find(rel);
+	if (listed)
+	{
+		if (it == folders.end())
+		{
+			// dropped meanwhile, so there's no count to hand the parent
+			Release(sub);
+			auto parent = rel.empty() ? folders.end() : folders.find(up);
+			if (parent != folders.end() && parent->second.counted.count(base)) Drop(up, false);
+			return;
+		}
+		
+		Folder &f = it->second;
+		f.Patch(name, found ? &rec : nullptr);
+		
+		// the watch on a subfolder comes and goes with its record
+		auto c = f.counted.find(name);
+		if (c != f.counted.end())
+		{
+			Release(c->second);
+			f.counted.erase(c);
+		}
+		if (found && FolderRecord(rec))
+		{
+			if (sub < 0)
+			{
+				// its count can't be kept right, so neither can the listing
+				Drop(rel, false);
+				return;
+			}
+			f.counted.emplace(name, sub);
+		}
+		else
+			Release(sub);
+		
+		items = f.count;
+	}
+	
+	// and the folder's own entry in its parent shows how many items it has
+	auto parent = rel.empty() ? folders.end() : folders.find(up);
+	if (parent != folders.end())
+	{
+		auto c = parent->second.counted.find(base);
+		if (c != parent->second.counted.end() && c->second == wd) parent->second.SetSize(base, items);
+	}
+}
@@ -1,7 +1,5 @@
 #include <boost/endian/conversion.hpp>
 #include <ctime>
-#include <iomanip>
-#include <iostream>
 
 #include "globals.hpp"
 
@@ -12,11 +10,11 @@ static const uint32_t MONTH_SECS[12] =
 	28857600
 };
 
-DateTime::DateTime(std::istream &s)
+DateTime::DateTime(const uint8_t *p)
 {
-	s.read(reinterpret_cast<char*>(&year), 2);
-	s.read(reinterpret_cast<char*>(&msecs), 2);
-	s.read(reinterpret_cast<char*>(&secs), 4);
+	year = boost::endian::load_big_u16(p);
+	msecs = boost::endian::load_big_u16(p+2);
+	secs = boost::endian::load_big_u32(p+4);
 }
 
 std::chrono::system_clock::time_point DateTime::TimePoint() const
@@ -87,13 +85,3 @@ void DateTime::FromTimePoint(const std::chrono::system_clock::time_point &tp)
 	secs = MONTH_SECS[st.tm_mon] + (st.tm_mon > 1 && !(year%4) ? 86400 : 0) +
 		(st.tm_sec + (60 * (st.tm_min+60 * ((st.tm_hour+24 * (st.tm_mday-1))))));
 }
-
-void Log(std::string txt)
-{
-	using namespace std::chrono;
-	
-	static time_t present;
-	present = system_clock::to_time_t(system_clock::now());
-	
-	std::cout << '[' << std::put_time(localtime(&present), "%D %T") << "]: " << txt << '\n';
-}
@@ -0,0 +1,274 @@
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "files.hpp"
+#include "globals.hpp"
+#include "hashes.hpp"
+
+static bool KeyOf(int fd, uint64_t &dev, uint64_t &ino, uint64_t &size, int64_t &mtime)
+{
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) return false;
+	
+	dev = st.st_dev;
+	ino = st.st_ino;
+	size = st.st_size;
+	mtime = int64_t(st.st_mtim.tv_sec)*1000000000+st.st_mtim.tv_nsec;
+	return true;
+}
+
+HashPool::Job::~Job()
+{
+	if (fd >= 0) close(fd);
+	EVP_MD_CTX_free(md5);
+	EVP_MD_CTX_free(sha1);
+}
+
+HashPool::HashPool(const std::string &db_path, const std::string &root, unsigned nthreads, bool sweep):
+	work(new boost::asio::io_service::work(io)),
+	root(root),
+	db(nullptr),
+	select(nullptr),
+	upsert(nullptr),
+	swept(0)
+{
+	// our own lock serialises access, SQLite needn't bother
+	if (sqlite3_open_v2(db_path.c_str(), &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX,
+		nullptr) != SQLITE_OK)
+	{
+		std::string err = db ? sqlite3_errmsg(db) : "out of memory";
+		sqlite3_close(db);
+		throw std::runtime_error("Can't open hash database " + db_path + ": " + err);
+	}
+	
+	try
+	{
+		// losing the last few to a crash only means hashing them again
+		Exec("PRAGMA journal_mode=WAL");
+		Exec("PRAGMA synchronous=NORMAL");
+		Exec("CREATE TABLE IF NOT EXISTS hashes ("
+			"dev INTEGER NOT NULL, "
+			"ino INTEGER NOT NULL, "
+			"size INTEGER NOT NULL, "
+			"mtime INTEGER NOT NULL, "
+			"md5 BLOB NOT NULL, "
+			"sha1 BLOB NOT NULL, "
+			"PRIMARY KEY (dev, ino))");
+		
+		select = Prepare("SELECT md5, sha1 FROM hashes WHERE dev = ?1 AND ino = ?2 AND size = ?3 AND mtime = ?4");
+		upsert = Prepare("INSERT OR REPLACE INTO hashes (dev, ino, size, mtime, md5, sha1) VALUES (?1, ?2, ?3, ?4, ?5, ?6)");
+	}
+	catch (...)
+	{
+		Close();
+		throw;
+	}
+	
+	if (sweep)
+	{
+		this->sweep.reset(new FolderWalk(root));
+		boost::asio::post(io, [this]() { Sweep(); });
+	}
+	
+	for (unsigned i = 0; i < std::max(1u, nthreads); i++)
+		threads.create_thread([this]() { io.run(); });
+}
+
+HashPool::~HashPool()
+{
+	work.reset();
+	io.stop();
+	threads.join_all();
+	Close();
+}
+
+void HashPool::Close()
+{
+	for (auto s: { select, upsert }) sqlite3_finalize(s);
+	sqlite3_close(db);
+}
+
+void HashPool::Exec(const char *sql)
+{
+	char *err = nullptr;
+	if (sqlite3_exec(db, sql, nullptr, nullptr, &err) != SQLITE_OK)
+	{
+		std::string msg = err ? err : sqlite3_errmsg(db);
+		sqlite3_free(err);
+		throw std::runtime_error("[Hashes]: " + msg);
+	}
+}
+
+sqlite3_stmt* HashPool::Prepare(const char *sql)
+{
+	sqlite3_stmt *s = nullptr;
+	if (sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &s, nullptr) != SQLITE_OK)
+		throw std::runtime_error(std::string("[Hashes]: ") + sqlite3_errmsg(db));
+	return s;
+}
+
+bool HashPool::Lookup(const Key &k, FileHashes &h)
+{
+	std::lock_guard<std::mutex> guard(db_lock);
+	
+	sqlite3_bind_int64(select, 1, static_cast<sqlite3_int64>(k.dev));
+	sqlite3_bind_int64(select, 2, static_cast<sqlite3_int64>(k.ino));
+	sqlite3_bind_int64(select, 3, static_cast<sqlite3_int64>(k.size));
+	sqlite3_bind_int64(select, 4, k.mtime);
+	
+	// a row for the same inode at another size or time is a file that's changed since
+	int rc = sqlite3_step(select);
+	bool found = rc == SQLITE_ROW && sqlite3_column_bytes(select, 0) == MD5_DIGEST_LENGTH &&
+		sqlite3_column_bytes(select, 1) == SHA_DIGEST_LENGTH;
+	if (found)
+	{
+		std::memcpy(h.md5, sqlite3_column_blob(select, 0), MD5_DIGEST_LENGTH);
+		std::memcpy(h.sha1, sqlite3_column_blob(select, 1), SHA_DIGEST_LENGTH);
+	}
+	else if (rc != SQLITE_ROW && rc != SQLITE_DONE)
+		Log(LL_ERROR, std::string("[Hashes]: ") + sqlite3_errmsg(db));
+	
+	sqlite3_reset(select);
+	sqlite3_clear_bindings(select);
+	return found;
+}
+
+void HashPool::Store(const Key &k, const FileHashes &h)
+{
+	std::lock_guard<std::mutex> guard(db_lock);
+	
+	sqlite3_bind_int64(upsert, 1, static_cast<sqlite3_int64>(k.dev));
+	sqlite3_bind_int64(upsert, 2, static_cast<sqlite3_int64>(k.ino));
+	sqlite3_bind_int64(upsert, 3, static_cast<sqlite3_int64>(k.size));
+	sqlite3_bind_int64(upsert, 4, k.mtime);
+	sqlite3_bind_blob(upsert, 5, h.md5, sizeof(h.md5), SQLITE_TRANSIENT);
+	sqlite3_bind_blob(upsert, 6, h.sha1, sizeof(h.sha1), SQLITE_TRANSIENT);
+	
+	if (sqlite3_step(upsert) != SQLITE_DONE) Log(LL_ERROR, std::string("[Hashes]: ") + sqlite3_errmsg(db));
+	sqlite3_reset(upsert);
+	sqlite3_clear_bindings(upsert);
+}
+
+void HashPool::Hash(const std::string &path, Callback cb)
+{
+	boost::asio::post(io, [this, path, cb]() { Start(path, cb); });
+}
+
+void HashPool::Start(const std::string &path, Callback cb)
+{
+	auto job = std::make_shared<Job>();
+	Key &k = job->key;
+	FileHashes h;
+	
+	job->fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (job->fd < 0 || !KeyOf(job->fd, k.dev, k.ino, k.size, k.mtime) || !job->md5 || !job->sha1)
+	{
+		cb(false, h);
+		return;
+	}
+	
+	if (Lookup(k, h))
+	{
+		cb(true, h);
+		return;
+	}
+	
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		
+		// someone's reading it already, wait for them
+		auto it = running.find(std::make_pair(k.dev, k.ino));
+		if (it != running.end())
+		{
+			it->second->waiting.push_back(cb);
+			return;
+		}
+		
+		job->path = path;
+		job->waiting.push_back(cb);
+		running.emplace(std::make_pair(k.dev, k.ino), job);
+	}
+	
+	if (!EVP_DigestInit_ex(job->md5, EVP_md5(), nullptr) || !EVP_DigestInit_ex(job->sha1, EVP_sha1(), nullptr))
+		return Finish(job, false);
+	
+	posix_fadvise(job->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	Step(job);
+}
+
+void HashPool::Step(std::shared_ptr<Job> job)
+{
+	static thread_local std::unique_ptr<uint8_t[]> buf(new uint8_t[HASH_BUFFER_SIZE]);
+	size_t budget = HASH_SLICE;
+	
+	while (budget)
+	{
+		ssize_t n = read(job->fd, buf.get(), std::min<size_t>(budget, HASH_BUFFER_SIZE));
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0)
+		{
+			Log(LL_WARNING, "[Hashes]: " + job->path + ": " + strerror(errno));
+			return Finish(job, false);
+		}
+		if (n == 0) return Finish(job, true);
+		
+		if (!EVP_DigestUpdate(job->md5, buf.get(), n) || !EVP_DigestUpdate(job->sha1, buf.get(), n))
+			return Finish(job, false);
+		budget -= n;
+	}
+	
+	// back of the queue, so the next slice waits behind whatever else has been asked for
+	boost::asio::post(io, [this, job]() { Step(job); });
+}
+
+void HashPool::Finish(std::shared_ptr<Job> job, bool ok)
+{
+	FileHashes h;
+	Key now;
+	
+	if (ok)
+	{
+		ok = EVP_DigestFinal_ex(job->md5, h.md5, nullptr) && EVP_DigestFinal_ex(job->sha1, h.sha1, nullptr);
+		
+		// a file that changed while it was being read has no one hash to give
+		ok = ok && KeyOf(job->fd, now.dev, now.ino, now.size, now.mtime) &&
+			now.size == job->key.size && now.mtime == job->key.mtime;
+		if (ok) Store(job->key, h);
+	}
+	
+	std::vector<Callback> waiting;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		running.erase(std::make_pair(job->key.dev, job->key.ino));
+		waiting.swap(job->waiting);
+	}
+	
+	for (auto &cb: waiting) cb(ok, h);
+}
+
+void HashPool::Sweep()
+{
+	FolderWalk::Item item;
+	
+	// one file at a time, whether it's read or found in the database, so whatever's asked for
+	// meanwhile never waits behind more than a slice of it
+	while (sweep->Next(item))
+	{
+		if (item.folder) continue;
+		
+		swept++;
+		Start(JoinPath(root, item.rel),
+			[this](bool, const FileHashes&)
+			{
+				boost::asio::post(io, [this]() { Sweep(); });
+			});
+		return;
+	}
+	
+	sweep.reset();
+	Log("Hashes: Background pass done, " + std::to_string(swept) + " files");
+}
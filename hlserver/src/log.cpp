@@ -0,0 +1,219 @@
+#include <cstdio>
+#include <ctime>
+#include <sys/stat.h>
+
+#include "log.hpp"
+
+static const char *LEVEL_NAMES[] = { "DEBUG", "INFO", "WARNING", "ERROR" };
+
+Logger& Logger::Instance()
+{
+	static Logger logger;
+	return logger;
+}
+
+Logger::Logger():
+	ring(new Slot[LOG_RING_SIZE]),
+	head(0),
+	tail(0),
+	dropped(0),
+	level(LL_INFO),
+	idle(false),
+	stop(false),
+	reconfigure(false),
+	out(stdout),
+	out_size(0),
+	reported_drops(0)
+{
+	for (size_t i = 0; i < LOG_RING_SIZE; i++) ring[i].seq.store(i, std::memory_order_relaxed);
+	writer = std::thread([this]() { Run(); });
+}
+
+Logger::~Logger()
+{
+	stop = true;
+	{
+		std::lock_guard<std::mutex> guard(wake_lock);
+		wake.notify_one();
+	}
+	writer.join();
+	
+	if (out != stdout) fclose(out);
+}
+
+void Logger::Configure(const LogConfig &c)
+{
+	level = c.level;
+	
+	std::lock_guard<std::mutex> guard(config_lock);
+	next_config.reset(new LogConfig(c));
+	reconfigure = true;
+}
+
+void Logger::Push(LogLevel l, std::string txt)
+{
+	if (!Enabled(l)) return;
+	
+	// claim a slot, the same way a bounded MPMC queue does; a slot whose sequence lags behind
+	// still holds a record the writer hasn't got to, so the ring is full
+	size_t pos = head.load(std::memory_order_relaxed);
+	Slot *s;
+	for (;;)
+	{
+		s = &ring[pos & (LOG_RING_SIZE-1)];
+		size_t seq = s->seq.load(std::memory_order_acquire);
+		intptr_t diff = static_cast<intptr_t>(seq)-static_cast<intptr_t>(pos);
+		
+		if (diff == 0)
+		{
+			if (head.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)) break;
+		}
+		else if (diff < 0)
+		{
+			dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		else
+			pos = head.load(std::memory_order_relaxed);
+	}
+	
+	s->when = std::chrono::system_clock::now();
+	s->level = l;
+	s->text = std::move(txt);
+	s->seq.store(pos+1, std::memory_order_release);
+	
+	// the writer naps between batches, only bother waking it if it has actually gone to sleep
+	if (idle.load(std::memory_order_acquire))
+	{
+		idle = false;
+		wake.notify_one();
+	}
+}
+
+void Logger::Run()
+{
+	for (;;)
+	{
+		if (reconfigure.exchange(false))
+		{
+			std::lock_guard<std::mutex> guard(config_lock);
+			config = *next_config;
+			Open();
+		}
+		
+		bool wrote = Drain();
+		
+		uint64_t d = dropped.load(std::memory_order_relaxed);
+		if (d != reported_drops)
+		{
+			Write(std::chrono::system_clock::now(), LL_WARNING,
+				"Logger: " + std::to_string(d-reported_drops) + " message(s) dropped");
+			reported_drops = d;
+			wrote = true;
+		}
+		if (wrote) fflush(out);
+		
+		if (stop)
+		{
+			if (!Drain()) break;
+			continue;
+		}
+		
+		// a producer that misses the idle flag only costs a short delay, never a lost record
+		std::unique_lock<std::mutex> guard(wake_lock);
+		idle = true;
+		wake.wait_for(guard, std::chrono::milliseconds(100));
+		idle = false;
+	}
+	
+	fflush(out);
+}
+
+bool Logger::Drain()
+{
+	bool any = false;
+	
+	for (;;)
+	{
+		Slot &s = ring[tail & (LOG_RING_SIZE-1)];
+		if (s.seq.load(std::memory_order_acquire) != tail+1) break;
+		
+		Write(s.when, s.level, s.text);
+		s.text.clear();
+		s.seq.store(tail+LOG_RING_SIZE, std::memory_order_release);
+		++tail;
+		any = true;
+	}
+	
+	return any;
+}
+
+void Logger::Write(std::chrono::system_clock::time_point when, LogLevel l, const std::string &txt)
+{
+	time_t t = std::chrono::system_clock::to_time_t(when);
+	tm st;
+	localtime_r(&t, &st);
+	
+	char stamp[32];
+	strftime(stamp, sizeof(stamp), "%D %T", &st);
+	
+	std::string line;
+	line.reserve(txt.size()+48);
+	line.append(1, '[').append(stamp).append("]: ");
+	if (l != LL_INFO) line.append(LEVEL_NAMES[l]).append(": ");
+	line.append(txt);
+	
+	WriteLine(line);
+}
+
+void Logger::WriteLine(const std::string &line)
+{
+	fwrite(line.data(), 1, line.size(), out);
+	fputc('\n', out);
+	out_size += line.size()+1;
+	
+	if (out != stdout && config.max_size && out_size >= config.max_size) Rotate();
+}
+
+void Logger::Open()
+{
+	if (out != stdout) fclose(out);
+	out = stdout;
+	out_size = 0;
+	
+	if (config.path.empty()) return;
+	
+	FILE *f = fopen(config.path.c_str(), "a");
+	if (!f)
+	{
+		Write(std::chrono::system_clock::now(), LL_ERROR, "Logger: Can't open " + config.path + ", logging to stdout");
+		return;
+	}
+	
+	struct stat st;
+	if (fstat(fileno(f), &st) == 0) out_size = st.st_size;
+	out = f;
+}
+
+void Logger::Rotate()
+{
+	fclose(out);
+	out = stdout;
+	
+	// hotline.log.4 -> hotline.log.5, ... hotline.log -> hotline.log.1
+	if (config.keep)
+	{
+		for (unsigned i = config.keep-1; i > 0; i--)
+			rename((config.path+'.'+std::to_string(i)).c_str(), (config.path+'.'+std::to_string(i+1)).c_str());
+		rename(config.path.c_str(), (config.path+".1").c_str());
+	}
+	else
+		remove(config.path.c_str());
+	
+	Open();
+}
+
+void Log(LogLevel l, std::string txt)
+{
+	Logger::Instance().Push(l, std::move(txt));
+}
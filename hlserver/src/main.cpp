@@ -1,22 +1,174 @@
-#include <boost/bind.hpp>
-#include <boost/thread.hpp>
+#include <cstdlib>
+#include <cstring>
 #include <exception>
+#include <csignal>
+#include <getopt.h>
 #include <iostream>
 
 #include "server.hpp"
 
+static void Usage(const char *self)
+{
+	std::cerr << "Usage: " << self << " [options]\n"
+		"  -p, --port <n>              listen on port n (default 5500)\n"
+		"      --send-high-water <n>   bytes queued per client before shedding it (default 1048576)\n"
+		"  -t, --threads <n>           event loops to run (default one per core)\n"
+		"      --pin-cpus              pin each event loop to its own CPU\n"
+		"      --resolver-threads <n>  threads doing reverse DNS lookups (default 2)\n"
+		"      --host-cache-ttl <n>    seconds to remember a host name (default 3600)\n"
+		"      --log-file <path>       log here instead of stdout\n"
+		"      --log-size <n>          bytes before the log file is rotated (default 67108864)\n"
+		"      --log-keep <n>          rotated log files to keep (default 5)\n"
+		"      --log-level <level>     debug, info, warning or error (default info)\n"
+		"      --metrics-port <n>      serve Prometheus metrics on 127.0.0.1:n\n"
+		"      --capture <path>        record what clients send, passwords and all, for hlreplay\n"
+		"                              (a new file, readable only by the server's user)\n"
+		"      --accounts <path>       account database (default accounts.db)\n"
+		"      --crypto-threads <n>    threads checking passwords (default 2)\n"
+		"      --crypto-queue <n>      password checks allowed to wait before logins are refused (default 256)\n"
+		"      --files <path>          the file root (default files)\n"
+		"      --file-list-cache <n>   folders whose listings are kept (default 1024)\n"
+		"      --index-threads <n>     threads building the file search index, 0 for no search (default 2)\n"
+		"      --hash-threads <n>      threads hashing files, 0 for no hashes (default 2)\n"
+		"      --hashes <path>         file hash database (default hashes.db)\n"
+		"      --no-hash-sweep         only hash files when asked, not all of them in the background\n"
+		"      --transfer-threads <n>  threads serving file transfers on port+1 (default 2)\n"
+		"      --upload-sync <policy>  when uploads hit the disk: none, close (once per file, the default),\n"
+		"                              or a number of MiB between syncs\n";
+}
+
+static bool ParseLevel(const char *s, LogLevel &level)
+{
+	static const char *names[] = { "debug", "info", "warning", "error" };
+	
+	for (int i = LL_DEBUG; i <= LL_ERROR; i++)
+	{
+		if (strcmp(s, names[i]) == 0)
+		{
+			level = static_cast<LogLevel>(i);
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+static bool ParseSync(const char *s, ServerConfig &config)
+{
+	if (strcmp(s, "none") == 0)
+		config.upload_sync = SYNC_NONE;
+	else if (strcmp(s, "close") == 0)
+		config.upload_sync = SYNC_CLOSE;
+	else
+	{
+		uint64_t mib = std::strtoull(s, nullptr, 10);
+		if (!mib) return false;
+		
+		config.upload_sync = SYNC_INTERVAL;
+		config.upload_sync_interval = mib*1024*1024;
+	}
+	
+	return true;
+}
+
+static bool ParseArgs(int argc, char **argv, ServerConfig &config, LogConfig &log)
+{
+	enum
+	{
+		OPT_SEND_HIGH_WATER = 256, OPT_PIN_CPUS, OPT_RESOLVER_THREADS, OPT_HOST_CACHE_TTL,
+		OPT_LOG_FILE, OPT_LOG_SIZE, OPT_LOG_KEEP, OPT_LOG_LEVEL,
+		OPT_METRICS_PORT, OPT_CAPTURE, OPT_ACCOUNTS,
+		OPT_CRYPTO_THREADS, OPT_CRYPTO_QUEUE, OPT_FILES, OPT_TRANSFER_THREADS,
+		OPT_UPLOAD_SYNC, OPT_FILE_LIST_CACHE, OPT_INDEX_THREADS,
+		OPT_HASH_THREADS, OPT_HASHES, OPT_NO_HASH_SWEEP
+	};
+	
+	static const option opts[] =
+	{
+		{ "port", required_argument, nullptr, 'p' },
+		{ "send-high-water", required_argument, nullptr, OPT_SEND_HIGH_WATER },
+		{ "threads", required_argument, nullptr, 't' },
+		{ "pin-cpus", no_argument, nullptr, OPT_PIN_CPUS },
+		{ "resolver-threads", required_argument, nullptr, OPT_RESOLVER_THREADS },
+		{ "host-cache-ttl", required_argument, nullptr, OPT_HOST_CACHE_TTL },
+		{ "log-file", required_argument, nullptr, OPT_LOG_FILE },
+		{ "log-size", required_argument, nullptr, OPT_LOG_SIZE },
+		{ "log-keep", required_argument, nullptr, OPT_LOG_KEEP },
+		{ "log-level", required_argument, nullptr, OPT_LOG_LEVEL },
+		{ "metrics-port", required_argument, nullptr, OPT_METRICS_PORT },
+		{ "capture", required_argument, nullptr, OPT_CAPTURE },
+		{ "accounts", required_argument, nullptr, OPT_ACCOUNTS },
+		{ "crypto-threads", required_argument, nullptr, OPT_CRYPTO_THREADS },
+		{ "crypto-queue", required_argument, nullptr, OPT_CRYPTO_QUEUE },
+		{ "files", required_argument, nullptr, OPT_FILES },
+		{ "transfer-threads", required_argument, nullptr, OPT_TRANSFER_THREADS },
+		{ "upload-sync", required_argument, nullptr, OPT_UPLOAD_SYNC },
+		{ "file-list-cache", required_argument, nullptr, OPT_FILE_LIST_CACHE },
+		{ "index-threads", required_argument, nullptr, OPT_INDEX_THREADS },
+		{ "hash-threads", required_argument, nullptr, OPT_HASH_THREADS },
+		{ "hashes", required_argument, nullptr, OPT_HASHES },
+		{ "no-hash-sweep", no_argument, nullptr, OPT_NO_HASH_SWEEP },
+		{ "help", no_argument, nullptr, 'h' },
+		{ nullptr, 0, nullptr, 0 }
+	};
+	
+	int c;
+	while ((c = getopt_long(argc, argv, "p:t:h", opts, nullptr)) != -1)
+	{
+		switch (c)
+		{
+			case 'p': config.port = std::strtoul(optarg, nullptr, 10); break;
+			case OPT_SEND_HIGH_WATER: config.send_high_water = std::strtoull(optarg, nullptr, 10); break;
+			case 't': config.threads = std::strtoul(optarg, nullptr, 10); break;
+			case OPT_PIN_CPUS: config.pin_threads = true; break;
+			case OPT_RESOLVER_THREADS: config.resolver_threads = std::strtoul(optarg, nullptr, 10); break;
+			case OPT_HOST_CACHE_TTL: config.host_cache_ttl = std::chrono::seconds(std::strtoul(optarg, nullptr, 10)); break;
+			case OPT_LOG_FILE: log.path = optarg; break;
+			case OPT_LOG_SIZE: log.max_size = std::strtoull(optarg, nullptr, 10); break;
+			case OPT_LOG_KEEP: log.keep = std::strtoul(optarg, nullptr, 10); break;
+			case OPT_LOG_LEVEL:
+				if (ParseLevel(optarg, log.level)) break;
+				std::cerr << "Unknown log level: " << optarg << '\n';
+				return false;
+			case OPT_METRICS_PORT: config.metrics_port = std::strtoul(optarg, nullptr, 10); break;
+			case OPT_CAPTURE: config.capture_path = optarg; break;
+			case OPT_ACCOUNTS: config.accounts_path = optarg; break;
+			case OPT_CRYPTO_THREADS: config.crypto_threads = std::strtoul(optarg, nullptr, 10); break;
+			case OPT_CRYPTO_QUEUE: config.crypto_queue = std::strtoul(optarg, nullptr, 10); break;
+			case OPT_FILES: config.files_path = optarg; break;
+			case OPT_FILE_LIST_CACHE: config.file_list_cache_size = std::strtoul(optarg, nullptr, 10); break;
+			case OPT_INDEX_THREADS: config.index_threads = std::strtoul(optarg, nullptr, 10); break;
+			case OPT_HASH_THREADS: config.hash_threads = std::strtoul(optarg, nullptr, 10); break;
+			case OPT_HASHES: config.hashes_path = optarg; break;
+			case OPT_NO_HASH_SWEEP: config.hash_sweep = false; break;
+			case OPT_TRANSFER_THREADS: config.transfer_threads = std::strtoul(optarg, nullptr, 10); break;
+			case OPT_UPLOAD_SYNC:
+				if (ParseSync(optarg, config)) break;
+				std::cerr << "Unknown upload sync policy: " << optarg << '\n';
+				return false;
+			default:
+				Usage(argv[0]);
+				return false;
+		}
+	}
+	
+	return true;
+}
+
 int main(int argc, char **argv)
 {
-	using namespace boost::asio;
+	ServerConfig config;
+	LogConfig log;
+	if (!ParseArgs(argc, argv, config, log)) return 1;
+	Logger::Instance().Configure(log);
+	
+	// sendfile() has no MSG_NOSIGNAL, a client hanging up mid-download mustn't kill us
+	signal(SIGPIPE, SIG_IGN);
 	
 	try
 	{
-		io_service io;
-		tcp::endpoint ep(tcp::v4(), 5500);
-		Server *s = new Server(io, ep);
-		boost::thread io_thread(boost::bind(&io_service::run, &io));
-		io.run();
-		io_thread.detach();
+		Server s(config);
+		s.Run();
 	}
 	catch (std::exception &e)
 	{
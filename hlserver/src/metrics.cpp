@@ -0,0 +1,149 @@
+#include <algorithm>
+#include <cstdio>
+
+#include "log.hpp"
+#include "metrics.hpp"
+
+std::mutex Metrics::lock;
+std::vector<std::unique_ptr<Metrics::Shard>> Metrics::shards;
+
+Metrics::Shard& Metrics::Local()
+{
+	thread_local Shard *shard = nullptr;
+	
+	if (!shard)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		shards.emplace_back(new Shard()); // value-initialised, so everything starts at zero
+		shard = shards.back().get();
+	}
+	
+	return *shard;
+}
+
+size_t Metrics::Bucket(uint64_t ns)
+{
+	if (ns < (1 << LATENCY_SUB_BITS)) return ns;
+	
+	// the power of two picks the bucket group, the next few bits below it the bucket within it
+	unsigned e = 63-__builtin_clzll(ns);
+	size_t b = ((e-LATENCY_SUB_BITS+1) << LATENCY_SUB_BITS) +
+		((ns >> (e-LATENCY_SUB_BITS)) & ((1 << LATENCY_SUB_BITS)-1));
+	
+	return std::min<size_t>(b, LATENCY_BUCKETS-1);
+}
+
+uint64_t Metrics::BucketLimit(size_t b)
+{
+	if (b < (1 << LATENCY_SUB_BITS)) return b+1;
+	
+	unsigned e = (b >> LATENCY_SUB_BITS)+LATENCY_SUB_BITS-1;
+	uint64_t sub = b & ((1 << LATENCY_SUB_BITS)-1);
+	return ((1 << LATENCY_SUB_BITS)+sub+1) << (e-LATENCY_SUB_BITS);
+}
+
+void Metrics::Record(uint16_t opcode, std::chrono::nanoseconds d)
+{
+	Shard &s = Local();
+	if (opcode >= MAX_METRIC_OPCODE) opcode = 0;
+	
+	OpStats *op = s.ops[opcode].load(std::memory_order_relaxed);
+	if (!op)
+	{
+		op = new OpStats();
+		s.ops[opcode].store(op, std::memory_order_release); // lives as long as the process
+	}
+	
+	uint64_t ns = d.count() > 0 ? d.count() : 0;
+	auto bump = [](std::atomic<uint64_t> &v, uint64_t n) { v.store(v.load(std::memory_order_relaxed)+n, std::memory_order_relaxed); };
+	
+	bump(op->count, 1);
+	bump(op->sum_ns, ns);
+	bump(op->buckets[Bucket(ns)], 1);
+}
+
+void Metrics::Expose(std::string &out)
+{
+	static const struct
+	{
+		Counter c;
+		const char *name, *type, *help;
+	} counters[] =
+	{
+		{ MC_ACCEPTS, "hotline_accepted_connections_total", "counter", "Connections accepted." },
+		{ MC_BYTES_IN, "hotline_received_bytes_total", "counter", "Bytes read from clients." },
+		{ MC_BYTES_OUT, "hotline_sent_bytes_total", "counter", "Bytes written to clients." },
+		{ MC_QUEUED_BYTES, "hotline_queued_send_bytes", "gauge", "Bytes waiting to be written to clients." },
+		{ MC_DROPPED_FRAMES, "hotline_dropped_frames_total", "counter", "Low priority frames shed from full send queues." },
+		{ MC_LOGINS_REFUSED, "hotline_refused_logins_total", "counter", "Logins turned away because too many were waiting on a password check." },
+		{ MC_TRANSFER_BYTES_OUT, "hotline_transfer_sent_bytes_total", "counter", "File data and headers sent over HTXF." },
+		{ MC_TRANSFER_BYTES_IN, "hotline_transfer_received_bytes_total", "counter", "Uploaded file data and headers received over HTXF." },
+		{ MC_ACTIVE_TRANSFERS, "hotline_active_transfers", "gauge", "HTXF connections moving a file." }
+	};
+	static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	
+	std::lock_guard<std::mutex> guard(lock);
+	char buf[128];
+	
+	for (auto &c: counters)
+	{
+		int64_t v = 0;
+		for (auto &s: shards) v += s->counters[c.c].load(std::memory_order_relaxed);
+		
+		out.append("# HELP ").append(c.name).append(1, ' ').append(c.help).append(1, '\n');
+		out.append("# TYPE ").append(c.name).append(1, ' ').append(c.type).append(1, '\n');
+		out.append(c.name).append(1, ' ').append(std::to_string(v)).append(1, '\n');
+	}
+	
+	out.append("# HELP hotline_log_dropped_total Log records dropped because the log ring was full.\n"
+		"# TYPE hotline_log_dropped_total counter\n"
+		"hotline_log_dropped_total ").append(std::to_string(Logger::Instance().Dropped())).append(1, '\n');
+	
+	out.append("# HELP hotline_transaction_seconds Time to decode and handle a transaction, by opcode.\n"
+		"# TYPE hotline_transaction_seconds summary\n");
+	
+	std::vector<uint64_t> buckets(LATENCY_BUCKETS);
+	for (size_t op = 0; op < MAX_METRIC_OPCODE; op++)
+	{
+		uint64_t count = 0, sum = 0;
+		std::fill(buckets.begin(), buckets.end(), 0);
+		
+		for (auto &s: shards)
+		{
+			const OpStats *st = s->ops[op].load(std::memory_order_acquire);
+			if (!st) continue;
+			
+			count += st->count.load(std::memory_order_relaxed);
+			sum += st->sum_ns.load(std::memory_order_relaxed);
+			for (size_t b = 0; b < LATENCY_BUCKETS; b++) buckets[b] += st->buckets[b].load(std::memory_order_relaxed);
+		}
+		if (!count) continue;
+		
+		std::string label = op ? std::to_string(op) : "other";
+		
+		// the buckets are read a moment apart from the count, so go by their own total
+		uint64_t total = 0;
+		for (auto n: buckets) total += n;
+		
+		for (double q: quantiles)
+		{
+			uint64_t want = static_cast<uint64_t>(q*total+0.5), seen = 0;
+			size_t b = 0;
+			for (; b < LATENCY_BUCKETS-1; b++)
+			{
+				seen += buckets[b];
+				if (seen >= want && seen) break;
+			}
+			
+			snprintf(buf, sizeof(buf), "hotline_transaction_seconds{opcode=\"%s\",quantile=\"%g\"} %.9g\n",
+				label.c_str(), q, BucketLimit(b)/1e9);
+			out.append(buf);
+		}
+		
+		snprintf(buf, sizeof(buf), "hotline_transaction_seconds_sum{opcode=\"%s\"} %.9g\n", label.c_str(), sum/1e9);
+		out.append(buf);
+		snprintf(buf, sizeof(buf), "hotline_transaction_seconds_count{opcode=\"%s\"} %llu\n", label.c_str(),
+			static_cast<unsigned long long>(count));
+		out.append(buf);
+	}
+}
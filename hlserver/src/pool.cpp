@@ -0,0 +1,34 @@
+#include <atomic>
+
+#include "pool.hpp"
+
+std::shared_ptr<std::vector<uint8_t>> BufferPool::Get(size_t size)
+{
+	struct Ring
+	{
+		std::vector<std::shared_ptr<std::vector<uint8_t>>> bufs;
+		size_t next = 0;
+	};
+	
+	thread_local Ring ring;
+	
+	if (size > MAX_POOLED_BUFFER_SIZE)
+		return std::make_shared<std::vector<uint8_t>>(size);
+	
+	// only the ring can hand out new references, so once it holds the last one nobody else can
+	// pick the buffer back up
+	for (size_t i = 0; i < ring.bufs.size(); i++)
+	{
+		auto &b = ring.bufs[(ring.next+i) % ring.bufs.size()];
+		if (b.use_count() != 1) continue;
+		
+		std::atomic_thread_fence(std::memory_order_acquire); // see the last holder's release
+		ring.next = (ring.next+i+1) % ring.bufs.size();
+		b->resize(size);
+		return b;
+	}
+	
+	auto b = std::make_shared<std::vector<uint8_t>>(size);
+	if (ring.bufs.size() < MAX_POOLED_BUFFERS) ring.bufs.push_back(b);
+	return b;
+}
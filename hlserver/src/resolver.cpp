@@ -0,0 +1,112 @@
+#include <algorithm>
+
+#include "resolver.hpp"
+
+HostResolver::HostResolver(unsigned nthreads, size_t capacity, std::chrono::seconds ttl, std::chrono::seconds retry):
+	work(new boost::asio::io_service::work(io)),
+	capacity(capacity),
+	ttl(ttl),
+	retry(std::min(ttl, retry))
+{
+	backend = [this](const boost::asio::ip::address &addr, std::string &host)
+	{
+		boost::system::error_code ec;
+		tcp::resolver rslv(io);
+		auto it = rslv.resolve(tcp::endpoint(addr, 0), ec);
+		if (ec || it == tcp::resolver::iterator()) return false;
+		
+		host = it->host_name();
+		return true;
+	};
+	
+	// getnameinfo() blocks, so lookups get threads of their own
+	for (unsigned i = 0; i < std::max(1u, nthreads); i++)
+		threads.create_thread([this]() { io.run(); });
+}
+
+HostResolver::~HostResolver()
+{
+	work.reset();
+	io.stop();
+	threads.join_all();
+}
+
+void HostResolver::SetBackend(Backend b)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	backend = b;
+}
+
+void HostResolver::Resolve(const boost::asio::ip::address &addr, Callback cb)
+{
+	std::unique_lock<std::mutex> guard(lock);
+	
+	auto it = cache.find(addr);
+	if (it != cache.end())
+	{
+		if (it->second.expires > std::chrono::steady_clock::now())
+		{
+			lru.splice(lru.begin(), lru, it->second.lru);
+			std::string host = it->second.host;
+			guard.unlock();
+			cb(host);
+			return;
+		}
+		
+		lru.erase(it->second.lru);
+		cache.erase(it);
+	}
+	
+	// only one lookup per address no matter how many connections are waiting on it
+	auto &waiters = pending[addr];
+	waiters.push_back(cb);
+	if (waiters.size() > 1) return;
+	
+	guard.unlock();
+	boost::asio::post(io, [this, addr]() { Lookup(addr); });
+}
+
+void HostResolver::Lookup(const boost::asio::ip::address &addr)
+{
+	Backend b;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		b = backend;
+	}
+	
+	// an address with no name is an answer, but a DNS server that didn't answer may well next time
+	std::string host;
+	if (b(addr, host))
+		Store(addr, host, ttl);
+	else
+		Store(addr, addr.to_string(), retry);
+}
+
+void HostResolver::Store(const boost::asio::ip::address &addr, const std::string &host, std::chrono::seconds ttl)
+{
+	std::vector<Callback> waiters;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		
+		auto it = cache.find(addr);
+		if (it != cache.end()) lru.erase(it->second.lru);
+		
+		lru.push_front(addr);
+		cache[addr] = Entry { host, std::chrono::steady_clock::now()+ttl, lru.begin() };
+		
+		while (cache.size() > capacity && !lru.empty())
+		{
+			cache.erase(lru.back());
+			lru.pop_back();
+		}
+		
+		auto p = pending.find(addr);
+		if (p != pending.end())
+		{
+			waiters.swap(p->second);
+			pending.erase(p);
+		}
+	}
+	
+	for (auto &cb: waiters) cb(host);
+}
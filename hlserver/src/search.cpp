@@ -0,0 +1,468 @@
+#include <algorithm>
+#include <boost/endian/conversion.hpp>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "files.hpp"
+#include "search.hpp"
+
+enum
+{
+	INDEX_EVENTS = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ONLYDIR,
+	INDEX_RECHECKS = 3 // times a folder that keeps changing is looked over again before it's taken as read
+};
+
+static std::string Lower(std::string_view s)
+{
+	std::string k(s);
+	for (char &c: k)
+		if (c >= 'A' && c <= 'Z') c += 'a'-'A';
+	return k;
+}
+
+static uint32_t Gram(const char *p)
+{
+	return uint32_t(uint8_t(p[0])) << 16 | uint32_t(uint8_t(p[1])) << 8 | uint8_t(p[2]);
+}
+
+// Runs of letters and digits, counting anything outside ASCII as a letter so other scripts still
+// make words, and the whole name as well, so a prefix can run across them
+static std::vector<std::string> Words(const std::string &key)
+{
+	std::vector<std::string> w;
+	
+	for (size_t i = 0; i < key.size();)
+	{
+		auto word = [&](size_t j) { return uint8_t(key[j]) >= 0x80 || std::isalnum(uint8_t(key[j])); };
+		
+		size_t j = i;
+		while (j < key.size() && word(j)) j++;
+		if (j > i) w.emplace_back(key, i, j-i);
+		i = j+1;
+	}
+	
+	if (w.empty() || w[0] != key) w.push_back(key);
+	return w;
+}
+
+// Files and folders, with links followed to files but not to folders, which could lead back up the tree
+static bool Indexable(int dir, const char *name, struct stat &st)
+{
+	if (fstatat(dir, name, &st, AT_SYMLINK_NOFOLLOW) != 0) return false;
+	if (S_ISLNK(st.st_mode)) return fstatat(dir, name, &st, 0) == 0 && S_ISREG(st.st_mode);
+	return S_ISREG(st.st_mode) || S_ISDIR(st.st_mode);
+}
+
+FileIndex::FileIndex(const std::string &root, unsigned nthreads):
+	root(root),
+	work(new boost::asio::io_service::work(io)),
+	live(1),
+	dead(0),
+	folders_left(0),
+	started(std::chrono::steady_clock::now()),
+	ready(false),
+	out_of_watches(false),
+	inotify(inotify_init1(IN_CLOEXEC)),
+	stop(eventfd(0, EFD_CLOEXEC))
+{
+	entries.push_back(Entry { "", "", 0, 0, 0, { 'f', 'l', 'd', 'r' }, {}, true, false, -1 });
+	paths.emplace("", 0);
+	
+	if (inotify < 0 || stop < 0)
+		Log(LL_WARNING, std::string("No inotify, the file index won't see changes: ") + strerror(errno));
+	else
+		watcher = std::thread([this]() { Run(); });
+	
+	for (unsigned i = 0; i < std::max(1u, nthreads); i++)
+		threads.create_thread([this]() { io.run(); });
+	
+	folders_left++;
+	boost::asio::post(io, [this]() { Read(""); });
+}
+
+FileIndex::~FileIndex()
+{
+	if (watcher.joinable())
+	{
+		uint64_t one = 1;
+		if (write(stop, &one, sizeof(one)) == sizeof(one)) watcher.join();
+		else watcher.detach();
+	}
+	
+	work.reset();
+	io.stop();
+	threads.join_all();
+	
+	if (inotify >= 0) close(inotify);
+	if (stop >= 0) close(stop);
+}
+
+uint16_t FileIndex::Search(const Query &q, std::vector<uint8_t> &fields)
+{
+	using namespace boost::endian;
+	std::string text = Lower(q.text);
+	std::vector<uint32_t> found;
+	const std::vector<uint32_t> *candidates = nullptr;
+	
+	std::shared_lock<std::shared_mutex> guard(lock);
+	
+	if (q.prefix && !text.empty())
+	{
+		// every word starting with the text is next to the others in the map
+		for (auto it = words.lower_bound(text); it != words.end() && it->first.compare(0, text.size(), text) == 0; ++it)
+			found.insert(found.end(), it->second.begin(), it->second.end());
+		
+		std::sort(found.begin(), found.end());
+		found.erase(std::unique(found.begin(), found.end()), found.end());
+		candidates = &found;
+	}
+	else if (text.size() >= 3)
+	{
+		// only the names with the rarest three characters of the text need a look
+		for (size_t i = 0; i+3 <= text.size(); i++)
+		{
+			auto g = grams.find(Gram(&text[i]));
+			if (g == grams.end()) return 0;
+			if (!candidates || g->second.size() < candidates->size()) candidates = &g->second;
+		}
+	}
+	
+	uint16_t hits = 0;
+	auto check = [&](uint32_t id)
+	{
+		const Entry &e = entries[id];
+		if (!id || e.dead) return true;
+		if (!q.prefix && !text.empty() && e.key.find(text) == std::string::npos) return true;
+		if (q.type && load_big_u32(reinterpret_cast<const uint8_t*>(e.type)) != *q.type) return true;
+		if (q.creator && load_big_u32(reinterpret_cast<const uint8_t*>(e.creator)) != *q.creator) return true;
+		if (q.min_size && (e.folder || e.size < q.min_size)) return true;
+		
+		EncodeFileRecord(fields, e.name, e.type, e.creator, e.folder ? e.count : std::min<uint64_t>(e.size, UINT32_MAX));
+		
+		size_t at = fields.size();
+		fields.resize(at+4);
+		EncodeFilePath(fields, PathOf(e.parent));
+		store_big_u16(&fields[at], F_FILEPATH);
+		store_big_u16(&fields[at+2], fields.size()-at-4);
+		
+		return ++hits < SEARCH_MAX_RESULTS;
+	};
+	
+	if (candidates)
+	{
+		for (uint32_t id: *candidates)
+			if (!check(id)) break;
+	}
+	else
+	{
+		// two letters or fewer, or no text at all, and there's nothing to narrow it down
+		for (uint32_t id = 1; id < entries.size(); id++)
+			if (!check(id)) break;
+	}
+	
+	return hits;
+}
+
+FileIndex::Progress FileIndex::Status()
+{
+	std::shared_lock<std::shared_mutex> guard(lock);
+	return Progress { live-1, folders_left };
+}
+
+void FileIndex::Read(const std::string &rel)
+{
+	std::string path = JoinPath(root, rel);
+	int wd = -1;
+	
+	// watch first, so nothing that happens while the folder is being read goes unnoticed
+	{
+		std::unique_lock<std::shared_mutex> guard(lock);
+		
+		auto b = building.emplace(rel, false);
+		if (!b.second) b.first->second = true;
+		
+		if (watcher.joinable())
+		{
+			wd = inotify_add_watch(inotify, path.c_str(), INDEX_EVENTS);
+			if (wd >= 0)
+				watches[wd] = rel;
+			else if (errno == ENOSPC && !out_of_watches)
+			{
+				out_of_watches = true;
+				Log(LL_WARNING, "Index: Out of inotify watches, some folders won't be kept up to date (see fs.inotify.max_user_watches)");
+			}
+		}
+	}
+	
+	std::vector<Found> found;
+	if (DIR *d = opendir(path.c_str()))
+	{
+		while (dirent *e = readdir(d))
+		{
+			Found f { e->d_name, {} };
+			if (!HiddenFile(f.name) && ValidFileName(f.name) && Indexable(dirfd(d), e->d_name, f.st))
+				found.push_back(std::move(f));
+		}
+		closedir(d);
+	}
+	
+	std::unique_lock<std::shared_mutex> guard(lock);
+	
+	// if something changed, what was read may have gone since (anything that came meanwhile is in
+	// already), so look again, without the lock so searches don't wait on the disk
+	for (int pass = 0; pass < INDEX_RECHECKS; pass++)
+	{
+		auto b = building.find(rel);
+		if (b != building.end() && !b->second) break;
+		if (b == building.end())
+			building.emplace(rel, false);
+		else
+			b->second = false;
+		
+		guard.unlock();
+		found.erase(std::remove_if(found.begin(), found.end(),
+			[&](Found &f) { return !Indexable(AT_FDCWD, JoinPath(path, f.name).c_str(), f.st); }), found.end());
+		guard.lock();
+	}
+	building.erase(rel);
+	
+	auto folder = paths.find(rel);
+	if (folder != paths.end())
+	{
+		entries[folder->second].wd = wd;
+		for (auto &f: found) Add(JoinPath(rel, f.name), f.st);
+	}
+	else if (wd >= 0)
+	{
+		// it went while it was being read
+		watches.erase(wd);
+		inotify_rm_watch(inotify, wd);
+	}
+	
+	if (--folders_left == 0 && !ready)
+	{
+		ready = true;
+		auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now()-started);
+		Log("Index: " + std::to_string(live-1) + " files and folders in " + std::to_string(ms.count()) + " ms");
+	}
+}
+
+void FileIndex::Add(const std::string &rel, const struct stat &st)
+{
+	bool folder = S_ISDIR(st.st_mode);
+	
+	auto it = paths.find(rel);
+	if (it != paths.end())
+	{
+		Entry &e = entries[it->second];
+		if (e.folder == folder)
+		{
+			if (!folder) e.size = st.st_size;
+			return;
+		}
+		
+		// a file replaced by a folder, or the other way round
+		Remove(rel);
+	}
+	
+	size_t slash = rel.rfind('/');
+	std::string name = slash == std::string::npos ? rel : rel.substr(slash+1);
+	auto parent = paths.find(slash == std::string::npos ? std::string() : rel.substr(0, slash));
+	if (parent == paths.end()) return;
+	
+	uint32_t id = entries.size();
+	entries.push_back(Entry { name, Lower(name), parent->second, 0, folder ? 0 : uint64_t(st.st_size), {}, {}, folder, false, -1 });
+	
+	Entry &e = entries.back();
+	if (folder)
+		std::memcpy(e.type, "fldr", 4);
+	else
+		FileTypeCodes(name, e.type, e.creator);
+	
+	entries[parent->second].count++;
+	paths.emplace(rel, id);
+	live++;
+	Index(id);
+	
+	if (folder)
+	{
+		folders_left++;
+		boost::asio::post(io, [this, rel]() { Read(rel); });
+	}
+}
+
+void FileIndex::Index(uint32_t id)
+{
+	// entries only ever get bigger numbers, so pushing onto the back keeps every list sorted
+	const std::string &key = entries[id].key;
+	
+	for (size_t i = 0; i+3 <= key.size(); i++)
+	{
+		auto &ids = grams[Gram(&key[i])];
+		if (ids.empty() || ids.back() != id) ids.push_back(id);
+	}
+	
+	for (auto &w: Words(key))
+	{
+		auto &ids = words[w];
+		if (ids.empty() || ids.back() != id) ids.push_back(id);
+	}
+}
+
+void FileIndex::Remove(const std::string &rel)
+{
+	auto it = paths.find(rel);
+	if (it == paths.end() || rel.empty()) return;
+	
+	entries[entries[it->second].parent].count--;
+	
+	// the postings still name it, searches skip it until they're rebuilt
+	auto drop = [this](uint32_t id)
+	{
+		Entry &e = entries[id];
+		e.dead = true;
+		std::string().swap(e.name);
+		std::string().swap(e.key);
+		
+		if (e.wd >= 0)
+		{
+			watches.erase(e.wd);
+			inotify_rm_watch(inotify, e.wd);
+		}
+		
+		live--;
+		dead++;
+	};
+	
+	// "a/..." sorts between "a/" and "a0"
+	auto from = paths.lower_bound(rel+'/'), to = paths.lower_bound(rel+'0');
+	for (auto p = from; p != to; ++p) drop(p->second);
+	paths.erase(from, to);
+	
+	drop(it->second);
+	paths.erase(it);
+	
+	if (dead > INDEX_COMPACT_AFTER && dead > live) Compact();
+}
+
+void FileIndex::Compact()
+{
+	// renumber what's left in the same order, so the postings come out sorted again
+	std::vector<uint32_t> renumbered(entries.size(), 0);
+	std::vector<Entry> kept;
+	kept.reserve(live);
+	
+	for (uint32_t id = 0; id < entries.size(); id++)
+	{
+		if (entries[id].dead) continue;
+		renumbered[id] = kept.size();
+		kept.push_back(std::move(entries[id]));
+	}
+	
+	for (auto &e: kept) e.parent = renumbered[e.parent];
+	for (auto &p: paths) p.second = renumbered[p.second];
+	entries.swap(kept);
+	
+	grams.clear();
+	words.clear();
+	for (uint32_t id = 1; id < entries.size(); id++) Index(id);
+	dead = 0;
+}
+
+void FileIndex::Reset()
+{
+	for (auto &w: watches) inotify_rm_watch(inotify, w.first);
+	watches.clear();
+	for (auto &b: building) b.second = true;
+	
+	entries.resize(1);
+	entries[0].count = 0;
+	paths.clear();
+	paths.emplace("", 0);
+	grams.clear();
+	words.clear();
+	live = 1;
+	dead = 0;
+	
+	folders_left++;
+	boost::asio::post(io, [this]() { Read(""); });
+}
+
+void FileIndex::Run()
+{
+	alignas(inotify_event) char buf[64*1024];
+	pollfd fds[2] = { { inotify, POLLIN, 0 }, { stop, POLLIN, 0 } };
+	
+	for (;;)
+	{
+		if (poll(fds, 2, -1) < 0)
+		{
+			if (errno == EINTR) continue;
+			Log(LL_ERROR, std::string("Index watcher: ") + strerror(errno));
+			return;
+		}
+		if (fds[1].revents) return;
+		
+		ssize_t n = read(inotify, buf, sizeof(buf));
+		for (char *p = buf; n > 0 && p < buf+n;)
+		{
+			auto ev = reinterpret_cast<const inotify_event*>(p);
+			Handle(ev->wd, ev->mask, ev->len ? std::string(ev->name) : std::string());
+			p += sizeof(inotify_event)+ev->len;
+		}
+	}
+}
+
+void FileIndex::Handle(int wd, uint32_t mask, const std::string &name)
+{
+	std::unique_lock<std::shared_mutex> guard(lock);
+	
+	if (mask & IN_Q_OVERFLOW)
+	{
+		Log(LL_WARNING, "Index: Missed some changes, reading all the files again");
+		Reset();
+		return;
+	}
+	
+	auto w = watches.find(wd);
+	if (w == watches.end()) return;
+	std::string dir = w->second;
+	
+	// the folder's gone, and its parent has said so already
+	if (mask & IN_IGNORED)
+	{
+		auto p = paths.find(dir);
+		if (p != paths.end() && entries[p->second].wd == wd) entries[p->second].wd = -1;
+		watches.erase(w);
+		return;
+	}
+	
+	auto b = building.find(dir);
+	if (b != building.end()) b->second = true;
+	
+	if (HiddenFile(name) || !ValidFileName(name)) return;
+	std::string rel = JoinPath(dir, name);
+	
+	struct stat st;
+	if (mask & (IN_DELETE | IN_MOVED_FROM))
+		Remove(rel);
+	else if (Indexable(AT_FDCWD, JoinPath(root, rel).c_str(), st))
+		Add(rel, st);
+}
+
+std::string FileIndex::PathOf(uint32_t id) const
+{
+	std::vector<const std::string*> names;
+	for (; id; id = entries[id].parent) names.push_back(&entries[id].name);
+	
+	std::string rel;
+	for (auto n = names.rbegin(); n != names.rend(); ++n) rel = JoinPath(rel, **n);
+	return rel;
+}
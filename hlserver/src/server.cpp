@@ -1,9 +1,17 @@
 #include <algorithm>
+#include <boost/predef.h>
+#include <cstring>
+#include <fcntl.h>
 #include <iomanip>
 #include <iterator>
+#include <memory>
 #include <sstream>
 #include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include "files.hpp"
+#include "metrics.hpp"
 #include "server.hpp"
 #include "transactions.hpp"
 #include "users.hpp"
@@ -20,10 +28,15 @@ Server const* GlobalInstance()
 	return global_inst;
 }
 
-Server::Server(boost::asio::io_service &io, const tcp::endpoint &ep):
-	io(io),
-	listener(io, ep),
-	last_user_id(0),
+Server::Server(const ServerConfig &config):
+	config(config),
+	resolver(config.resolver_threads, config.host_cache_size, config.host_cache_ttl),
+	accounts(config.accounts_path, config.account_cache_size),
+	crypto(config.crypto_threads, config.crypto_queue),
+	transfers(config.port+1, config.transfer_threads, config.upload_sync, config.upload_sync_interval),
+	file_list(config.files_path, config.file_list_cache_size),
+	index(config.index_threads ? new FileIndex(config.files_path, config.index_threads) : nullptr),
+	hashes(config.hash_threads ? new HashPool(config.hashes_path, config.files_path, config.hash_threads, config.hash_sweep) : nullptr),
 	name("test")
 {
 	if (global_inst)
@@ -31,321 +44,516 @@ Server::Server(boost::asio::io_service &io, const tcp::endpoint &ep):
 	else
 		global_inst = this;
 	
-	Log("Server initialised");
-	Listen();
+	unsigned nloops = config.threads ? config.threads : std::max(1u, boost::thread::hardware_concurrency());
+	tcp::endpoint ep(tcp::v4(), config.port);
+	
+	if (!config.capture_path.empty()) capture.reset(new Capture(config.capture_path));
+	if (access(config.files_path.c_str(), R_OK | X_OK) != 0)
+		Log(LL_WARNING, "Can't read the file root " + config.files_path + ", there will be nothing to download");
+	
+	for (unsigned i = 0; i < nloops; i++)
+	{
+		loops.emplace_back(new boost::asio::io_service(1)); // each loop is only ever run by one thread
+		work.emplace_back(new boost::asio::io_service::work(*loops.back()));
+
+#ifdef SO_REUSEPORT
+		// every loop gets its own acceptor and the kernel spreads connections between them
+		typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port;
+		
+		auto l = new tcp::acceptor(*loops.back());
+		l->open(ep.protocol());
+		l->set_option(tcp::acceptor::reuse_address(true));
+		l->set_option(reuse_port(true));
+		l->bind(ep);
+		l->listen();
+		listeners.emplace_back(l);
+#else
+		if (i == 0) listeners.emplace_back(new tcp::acceptor(*loops.back(), ep));
+#endif // SO_REUSEPORT
+	}
+	
+	for (size_t i = 0; i < listeners.size(); i++) Listen(i);
+	
+	if (config.metrics_port)
+	{
+		// scrapes are rare and cheap, the first loop can take them
+		metrics_listener.reset(new tcp::acceptor(*loops[0],
+			tcp::endpoint(boost::asio::ip::address_v4::loopback(), config.metrics_port)));
+		ServeMetrics();
+	}
+	
+	Log("Server initialised with " + std::to_string(nloops) + " event loop(s)");
 }
 
-void Server::Disconnect(User *u)
+void Server::Run()
+{
+	unsigned ncpus = std::max(1u, boost::thread::hardware_concurrency());
+	
+	for (size_t i = 0; i < loops.size(); i++)
+	{
+		auto loop = loops[i].get();
+		boost::thread *t = threads.create_thread([loop]() { loop->run(); });
+
+#if BOOST_OS_LINUX
+		if (config.pin_threads)
+		{
+			cpu_set_t cpus;
+			CPU_ZERO(&cpus);
+			CPU_SET(i % ncpus, &cpus);
+			if (pthread_setaffinity_np(t->native_handle(), sizeof(cpus), &cpus) != 0)
+				Log(LL_WARNING, "Failed to pin event loop " + std::to_string(i));
+		}
+#endif // BOOST_OS_LINUX
+	}
+	
+	threads.join_all();
+}
+
+void Server::Disconnect(UserPtr u)
 {
 	u->Disconnect();
 	
-	if ((users.find(u->id) != users.end()) && !u->name.empty())
+	if (users.Remove(u))
+		user_list.Remove(u->id);
+	if (u->capture_id)
 	{
-		Log(std::string(u->name + " has disconnected."));
-		users.erase(u->id);
+		capture->Close(u->capture_id);
+		u->capture_id = 0;
 	}
+	
+	if (!u->name.empty())
+		Log(std::string(u->name + " has disconnected."));
 	else
-	{
 		Log(std::string(u->host + " has disconnected."));
-		delete u;
-	}
+	
+	// whatever completion handlers still hold the session release it
 }
 
-void Server::Listen()
+void Server::Listen(size_t i)
 {
-	auto u = new User(io);
+	// sessions stay on the loop that accepted them
+	auto u = std::allocate_shared<User>(PoolAllocator<User>(), *loops[i]);
+	u->send_limit = config.send_high_water;
 	
-	listener.async_accept(u->sock,
-		[this, u](boost::system::error_code ec)
+	listeners[i]->async_accept(u->sock,
+		[this, u, i](boost::system::error_code ec)
 		{
 			if (ec)
-			{
-				Resolve(u);
-				Disconnect(u);
-				Log(ec.message());
-			}
+				Log(LL_WARNING, ec.message());
 			else
 			{
 				//StartUser(u);
+				Metrics::Add(MC_ACCEPTS, 1);
 				Resolve(u);
 				Log("Incoming connection from " + u->host);
-				ValidateHello(u);
+				boost::asio::dispatch(u->strand, [this, u]() { ValidateHello(u); });
 			}
 			
-			Listen();
+			Listen(i);
 		});
 }
 
-void Server::Resolve(User *u)
+void Server::ServeMetrics()
 {
-	tcp::endpoint ep = u->sock.remote_endpoint();
-	tcp::resolver rslv(io);
-	u->host = rslv.resolve(ep)->host_name();
+	using namespace boost::asio;
+	
+	auto sock = std::make_shared<tcp::socket>(metrics_listener->get_executor());
+	
+	metrics_listener->async_accept(*sock,
+		[this, sock](boost::system::error_code ec)
+		{
+			// only closing the listener stops it; anything else, like running out of descriptors,
+			// costs one scrape and the next gets a fresh try, the same as Listen
+			if (ec == error::operation_aborted) return;
+			if (ec)
+			{
+				Log(LL_WARNING, "Metrics: "+ec.message());
+				ServeMetrics();
+				return;
+			}
+			
+			// whatever was asked for, the answer is the same, so don't wait for the whole request
+			std::string body;
+			body.append("# HELP hotline_connected_users Sessions past the handshake.\n"
+				"# TYPE hotline_connected_users gauge\n"
+				"hotline_connected_users ").append(std::to_string(users.Count())).append(1, '\n');
+			Metrics::Expose(body);
+			
+			auto reply = std::make_shared<std::string>(
+				"HTTP/1.0 200 OK\r\n"
+				"Content-Type: text/plain; version=0.0.4\r\n"
+				"Content-Length: "+std::to_string(body.size())+"\r\n"
+				"Connection: close\r\n\r\n"+body);
+			
+			async_write(*sock, buffer(*reply),
+				[sock, reply](boost::system::error_code ec, size_t)
+				{
+					sock->shutdown(tcp::socket::shutdown_both, ec);
+				});
+			
+			ServeMetrics();
+		});
 }
 
-/*void Server::StartUser(User *u)
+void Server::Resolve(UserPtr u)
 {
+	boost::system::error_code ec;
+	u->remote = u->sock.remote_endpoint(ec);
+	if (ec) return;
 	
+	// get going with the bare address, the name turns up whenever DNS gets around to it
+	u->host = u->remote.address().to_string();
+	resolver.Resolve(u->remote.address(),
+		[u](const std::string &host)
+		{
+			boost::asio::dispatch(u->strand, [u, host]() { u->host = host; });
+		});
+}
+
+/*void Server::StartUser(User *u)
+{
+
 }*/
 
-void Server::ValidateHello(User *u)
+void Server::ValidateHello(UserPtr u)
 {
 	using namespace boost::asio;
 	
-	char *hello = new char[12];
-	std::fill(hello, hello+12, 0);
+	static const char hello[12] = {'T', 'R', 'T', 'P', 'H', 'O', 'T', 'L', 0, 1, 0, 2 };
+	static const char reply[8] = {'T', 'R', 'T', 'P', 0, 0, 0, 0 };
+	
+	u->rx.resize(sizeof(hello));
 	
-	async_read(u->sock, buffer(hello, 12),
-		[this, u, hello](boost::system::error_code ec, size_t s)
+	async_read(u->sock, buffer(u->rx), bind_executor(u->strand,
+		[this, u](boost::system::error_code ec, size_t)
 		{
 			if (ec)
 			{
-				Log(ec.message());
+				Log(LL_WARNING, ec.message());
 				Disconnect(u);
 			}
-			else if (strncmp(hello, "TRTPHOTL\0\1\0\2", 12) != 0)
+			else if (!std::equal(u->rx.begin(), u->rx.end(), hello))
 			{
-				Log("["+u->host+"]: Bad connection greeting");
+				Log(LL_WARNING, "["+u->host+"]: Bad connection greeting");
 				Disconnect(u);
 			}
 			else
 			{
-				char reply[8] = {'T', 'R', 'T', 'P', 0, 0, 0, 0 };
-				async_write(u->sock, buffer(reply, 8),
-					[this, u](boost::system::error_code ec, size_t s)
+				async_write(u->sock, buffer(reply, 8), bind_executor(u->strand,
+					[this, u](boost::system::error_code ec, size_t)
 					{
 						if (ec)
 						{
-							Log(ec.message());;
+							Log(LL_WARNING, ec.message());
+							Disconnect(u);
+						}
+						else if (!users.Add(u))
+						{
+							Log(LL_WARNING, "["+u->host+"]: Server is full");
 							Disconnect(u);
 						}
 						else
 						{
-							u->id = ++last_user_id;
-							users.emplace(u->id, u);
+							if (capture) u->capture_id = capture->Open();
 							ReadTransaction(u);
 						}
-					});
+					}));
 			}
-			
-			delete[] hello;
-		});
+		}));
 }
 
-void Server::ReadTransaction(User *u)
+void Server::ReadTransaction(UserPtr u)
 {
 	using namespace boost::asio;
 	
-	char header[20];
+	// make sure there is somewhere to read into; a frame bigger than the buffer grows it
+	// (ParseTransactions has already checked it against MAX_TRANSACTION_SIZE)
+	size_t want = RX_BUFFER_SIZE;
+	if (u->rx_end-u->rx_start >= TRANSACTION_HEADER_SIZE)
+		want = std::max<size_t>(want, TRANSACTION_HEADER_SIZE+load_big_u32(&u->rx[u->rx_start+12]));
+	
+	if (u->rx_start && u->rx_start+want > u->rx.size())
+	{
+		std::memmove(u->rx.data(), u->rx.data()+u->rx_start, u->rx_end-u->rx_start);
+		u->rx_end -= u->rx_start;
+		u->rx_start = 0;
+	}
+	if (want > u->rx.size()) u->rx.resize(want);
 	
-	async_read(u->sock, buffer(header, 20),
-		[this, u, &header](boost::system::error_code ec, size_t s)
+	// everything a session does runs on its strand, so nothing here needs a lock
+	u->sock.async_read_some(buffer(u->rx.data()+u->rx_end, u->rx.size()-u->rx_end), bind_executor(u->strand,
+		[this, u](boost::system::error_code ec, size_t s)
 		{
-			u->lock.lock();
 			if (ec)
 			{
-				if (ec.value() != error::eof) Log(ec.message());
-				u->lock.unlock();
+				if (ec != error::eof && ec != error::operation_aborted) Log(LL_WARNING, ec.message());
 				Disconnect(u);
+				return;
 			}
-			else
-			{
-				std::istringstream hss(std::string(header, 20));
-				Transaction *trans = new Transaction(u, hss);
-				char *body = new char[trans->size];
-				async_read(u->sock, buffer(body, trans->size),
-					[this, u, body, trans](boost::system::error_code ec, size_t s)
-					{
-						if (ec)
-						{
-							Log(ec.message());
-							u->lock.unlock();
-							Disconnect(u);
-						}
-						else
-						{
-							std::istringstream tss(std::string(body, trans->size));
-							trans->ReadParams(tss);
-							delete[] body;
-							
-							switch (trans->type)
-							{
-								case OP_LOGIN: HandleLogin(u, trans); break;
-								case OP_AGREED: HandleAgreed(u, trans); break;
-								case OP_GETUSERNAMELIST:
-									delete trans;
-									HandleGetUserNameList(u);
-									break;
-								case OP_GETCLIENTINFOTEXT: HandleGetUserInfo(u, trans); break;
-								case OP_CHATSEND: HandleSendChat(u, trans); break;
-								default: u->lock.unlock();
-							}
-						}
-					});
-			}
-		});
+			
+			u->rx_end += s;
+			Metrics::Add(MC_BYTES_IN, s);
+			if (ParseTransactions(u)) ReadTransaction(u);
+		}));
 }
 
-void Server::HandleLogin(User *u, Transaction *trans)
+bool Server::ParseTransactions(UserPtr u)
 {
-	using namespace boost::asio;
-
-	std::ostringstream ss;
+	// clients may pipeline requests, so handle every complete one that came in with this read
+	// and only go back to the socket for the rest of a partial one
+	while (!u->verifying && u->rx_end-u->rx_start >= TRANSACTION_HEADER_SIZE)
+	{
+		const uint8_t *header = &u->rx[u->rx_start];
+		uint32_t size = load_big_u32(header+12);
+		
+		if (size > MAX_TRANSACTION_SIZE)
+		{
+			Log(LL_WARNING, "["+u->host+"]: Oversized transaction");
+			Disconnect(u);
+			return false;
+		}
+		if (u->rx_end-u->rx_start < TRANSACTION_HEADER_SIZE+size) break;
+		
+		auto start = std::chrono::steady_clock::now();
+		uint16_t opcode = load_big_u16(header+2);
+		if (u->capture_id) capture->Data(u->capture_id, header, TRANSACTION_HEADER_SIZE+size);
+		
+		Transaction *trans = new Transaction(u.get(), header);
+		if (!trans->ReadParams(header+TRANSACTION_HEADER_SIZE, size))
+		{
+			Log(LL_WARNING, "["+u->host+"]: Malformed transaction");
+			delete trans;
+			Disconnect(u);
+			return false;
+		}
+		
+		// handlers are done with the buffer by the time they return
+		u->rx_start += TRANSACTION_HEADER_SIZE+size;
+		if (!HandleTransaction(u, trans)) opcode = 0;
+		Metrics::Record(opcode, std::chrono::steady_clock::now()-start);
+	}
 	
-	if (trans->params.size() > 1)
+	if (u->rx_start == u->rx_end)
 	{
-		u->login = trans->params[0]->AsString();
-		std::vector<uint8_t> password = trans->params[1]->AsByteArray();
-		SHA256_Init(ctx);
-		SHA256_Update(ctx, &password[0], password.size());
-		SHA256_Final(u->pw_sum, ctx);
-		u->client_ver = trans->params[2]->AsInt16();
+		u->rx_start = u->rx_end = 0;
+		
+		// don't hang on to the room a big upload needed
+		if (u->rx.size() > RX_BUFFER_SIZE)
+		{
+			u->rx.resize(RX_BUFFER_SIZE);
+			u->rx.shrink_to_fit();
+		}
 	}
-	else
+	
+	// whatever came after a login waits for the verdict, FinishLogin picks up from here
+	return !u->verifying;
+}
+
+bool Server::HandleTransaction(UserPtr u, Transaction *trans)
+{
+	if (!u->logged_in && trans->type != OP_LOGIN)
 	{
-		u->login = "guest";
-		std::fill(std::begin(u->pw_sum), std::end(u->pw_sum), 0);
-		u->client_ver = trans->params[0]->AsInt16();
+		delete trans;
+		return false;
 	}
+	
+	switch (trans->type)
+	{
+		case OP_LOGIN: HandleLogin(u.get(), trans); break;
+		case OP_AGREED: HandleAgreed(u.get(), trans); break;
+		case OP_GETUSERNAMELIST:
+			delete trans;
+			HandleGetUserNameList(u.get());
+			break;
+		case OP_GETCLIENTINFOTEXT: HandleGetUserInfo(u.get(), trans); break;
+		case OP_SETCLIENTUSERINFO: HandleSetUserInfo(u.get(), trans); break;
+		case OP_CHATSEND: HandleSendChat(u.get(), trans); break;
+		case OP_NEWUSER: HandleNewUser(u.get(), trans); break;
+		case OP_DELETEUSER: HandleDeleteUser(u.get(), trans); break;
+		case OP_GETUSER: HandleGetUser(u.get(), trans); break;
+		case OP_SETUSER: HandleSetUser(u.get(), trans); break;
+		case OP_GETFILENAMELIST: HandleGetFileNameList(u.get(), trans); break;
+		case OP_INDEX: HandleSearchFiles(u.get(), trans); break;
+		case OP_INDEXSTATUS: HandleIndexStatus(u.get(), trans); break;
+		case OP_GETFILEINFO: HandleGetFileInfo(u.get(), trans); break;
+		case OP_DOWNLOADFILE: HandleDownloadFile(u.get(), trans); break;
+		case OP_DOWNLOADFLDR: HandleDownloadFolder(u.get(), trans); break;
+		case OP_UPLOADFILE: HandleUploadFile(u.get(), trans); break;
+		case OP_UPLOADFLDR: HandleUploadFolder(u.get(), trans); break;
+		default:
+			delete trans;
+			return false;
+	}
+	
+	return true;
+}
+
+void Server::HandleLogin(User *u, Transaction *trans)
+{
+	auto login = trans->Find(F_USERLOGIN);
+	auto password = trans->Find(F_USERPASSWORD);
+	auto vers = trans->Find(F_VERS);
+	
+	// both arrive scrambled, no login at all means the guest account
+	std::string l = login ? ConvertString(std::string(login->AsString())) : "guest";
+	std::string pw = password ? ConvertString(std::string(password->AsString())) : "";
+	uint16_t client_ver = vers ? vers->AsInt16() : 0;
 	delete trans;
 	
-	trans = new Transaction(u, 0, true, u->last_trans_id, 0);
-	trans->params.push_back(new Int16Param(F_USERID, last_user_id));
-	trans->params.push_back(new Int16Param(F_VERS, SERVER_VERSION));
-	trans->params.push_back(new Int16Param(F_COMMUNITYBANNERID, 0));
-	trans->params.push_back(new StringParam(F_SERVERNAME, name.data()));
-	trans->Write(ss, true);
+	// a second login gets an answer, or the client sits waiting for one
+	if (u->logged_in)
+	{
+		SendError(u, "You are already logged in.");
+		return;
+	}
+	
+	u->client_ver = client_ver;
+	
+	// broadcasts go on stamping last_trans_id while the password is checked, so hang on to this one
+	UserPtr p = u->shared_from_this();
+	uint32_t id = u->last_trans_id;
+	auto account = accounts.Find(l);
+	bool queued = crypto.Verify(account, std::move(pw),
+		[this, p, id, l, account](bool ok)
+		{
+			boost::asio::dispatch(p->strand,
+				[this, p, id, l, account, ok]()
+				{
+					FinishLogin(p, id, l, account, ok);
+					if (ParseTransactions(p)) ReadTransaction(p);
+				});
+		});
+	
+	if (!queued)
+	{
+		Metrics::Add(MC_LOGINS_REFUSED, 1);
+		SendError(u, "The server is busy, try again in a moment.");
+		u->CloseWhenFlushed();
+		return;
+	}
+	
+	u->verifying = true;
+}
+
+void Server::FinishLogin(UserPtr p, uint32_t id, const std::string &login, std::shared_ptr<const Account> account,
+	bool ok)
+{
+	User *u = p.get();
+	u->verifying = false;
+	
+	if (!ok)
+	{
+		Log(LL_WARNING, "["+u->host+"]: Failed login as " + login);
+		SendError(u, "Incorrect login.", id);
+		u->CloseWhenFlushed();
+		return;
+	}
+	
+	u->login = account->login;
+	u->access = account->access;
+	// accounts don't keep extra access; a hash is for checking a download, so it goes with downloading
+	u->extra_access[XA_FILEHASH] = account->access[UA_DOWNLOADFILE];
+	std::copy(std::begin(account->pw_sum), std::end(account->pw_sum), std::begin(u->pw_sum));
+	u->logged_in = true;
+	
+	Transaction *trans = new Transaction(u, 0, true, id, 0);
+	trans->AddInt16(F_USERID, u->id);
+	trans->AddInt16(F_VERS, SERVER_VERSION);
+	trans->AddInt16(F_COMMUNITYBANNERID, 0);
+	trans->AddString(F_SERVERNAME, name);
+	u->Send(trans->Encode(true));
 	delete trans;
 	
-	trans = new Transaction(u, OP_SHOWAGREEMENT, false, u->last_trans_id, 0);
+	trans = new Transaction(u, OP_SHOWAGREEMENT, false, id, 0);
 	if (agreement.empty())
-		trans->params.push_back(new Int16Param(F_NOSERVERAGREEMENT, 1));
+		trans->AddInt16(F_NOSERVERAGREEMENT, 1);
 	else
-		trans->params.push_back(new StringParam(F_DATA, agreement.data()));
-	trans->Write(ss, true);
+		trans->AddString(F_DATA, agreement);
+	u->Send(trans->Encode(true));
 	delete trans;
-	
-	async_write(u->sock, buffer(ss.str(), ss.str().size()),
-		[this, u](boost::system::error_code ec, size_t s)
-		{
-			if (ec)
-			{
-				Log(ec.message());
-				u->lock.unlock();
-				Disconnect(u);
-			}
-			else
-			{
-				u->lock.unlock();
-				ReadTransaction(u);
-			}
-		});
 }
 
 void Server::HandleAgreed(User *u, Transaction *trans)
 {
-	using namespace boost::asio;
-	
-	std::ostringstream ss;
-	uint64_t tmpacc = 0xFFF3CFEFFF800000LL; // TODO: reevaluate access bits
+	auto nick = trans->Find(F_USERNAME);
+	auto icon = trans->Find(F_USERICONID);
 	
-	u->name = trans->params[0]->AsString();
-	u->icon = trans->params[1]->AsInt16();
+	if (nick) u->name = nick->AsText();
+	if (icon) u->icon = icon->AsInt16();
 	// TODO: 3rd param is chat options, look into that
 	delete trans;
+	user_list.Update(u);
 	
 	trans = new Transaction(u, 0, true, u->last_trans_id, 0);
-	trans->Write(ss, true);
+	u->Send(trans->Encode(true));
 	delete trans;
 	
 	trans = new Transaction(u, OP_USERACCESS, false, u->last_trans_id, 0);
-	trans->params.push_back(new Int64Param(F_USERACCESS, tmpacc));
-	trans->params.push_back(new UserInfoParam(u));
-	trans->Write(ss, true);
+	trans->AddInt64(F_USERACCESS, AccessToWire(u->access));
+	trans->AddUserInfo(u);
+	u->Send(trans->Encode(true));
 	delete trans;
 	
 	trans = new Transaction(u, OP_SERVERBANNER, false, u->last_trans_id, 0);
-	trans->params.push_back(new Int32Param(F_SERVERBANNERTYPE, 0x55524C20)); // TODO: banner handling, using 'URL ' for now
-	trans->params.push_back(new StringParam(F_SERVERBANNERURL, "about:blank")); // most likely a 404
-	trans->Write(ss);
+	trans->AddInt32(F_SERVERBANNERTYPE, 0x55524C20); // TODO: banner handling, using 'URL ' for now
+	trans->AddString(F_SERVERBANNERURL, "about:blank"); // most likely a 404
+	u->Send(trans->Encode());
 	delete trans;
-	
-	async_write(u->sock, buffer(ss.str(), ss.str().size()),
-		[this, u](boost::system::error_code ec, size_t s)
-		{
-			if (ec)
-			{
-				Log(ec.message());
-				u->lock.unlock();
-				Disconnect(u);
-			}
-			else
-			{
-				u->lock.unlock();
-				ReadTransaction(u);
-			}
-		});
 }
 
 void Server::HandleGetUserNameList(User *u)
 {
-	using namespace boost::asio;
-	
-	std::ostringstream ss;
-	
+	// the list is kept encoded, so this is just a header in front of a shared buffer
+	auto listing = user_list.List(u->access[UA_VIEWHIDDENUSERS]);
 	auto trans = new Transaction(u, 0, true, u->last_trans_id, 0);
-	for (auto user: users) trans->params.push_back(new UserInfoParam(user.second));
-	trans->Write(ss, true);
+	u->Send(trans->Wrap(listing.fields, listing.count, true));
 	delete trans;
 	
-	async_write(u->sock, buffer(ss.str(), ss.str().size()),
-		[this, u](boost::system::error_code ec, size_t s)
-		{
-			if (ec)
-			{
-				Log(ec.message());
-				u->lock.unlock();
-				Disconnect(u);
-			}
-			else
-			{
-				Log(u->name + " successfully logged in.");
-				u->lock.unlock();
-				ReadTransaction(u);
-			}
-		});
+	Log(u->name + " successfully logged in.");
 }
 
 void Server::HandleGetUserInfo(User *u, Transaction *trans)
 {
-	using namespace boost::asio;
-	
-	std::ostringstream ss;
-	big_uint16_t uid = trans->params[0]->AsInt16();
+	auto target = trans->Find(F_USERID);
+	UserPtr who = users.Find(target ? target->AsInt16() : 0);
 	
 	delete trans;
-	trans = new Transaction(u, 0, true, u->last_trans_id, 0);
-	trans->params.push_back(new StringParam(F_USERNAME, users[uid]->name.data()));
-	trans->params.push_back(new StringParam(F_DATA, users[uid]->InfoText().data()));
-	trans->Write(ss, true);
-	delete trans;
+	if (!who)
+	{
+		SendError(u, "No such user.");
+		return;
+	}
 	
-	async_write(u->sock, buffer(ss.str(), ss.str().size()),
-		[this, u](boost::system::error_code ec, size_t s)
+	// the other session's fields are only safe to read on its own strand, and ours to write on ours
+	UserPtr p = u->shared_from_this();
+	uint32_t id = u->last_trans_id;
+	boost::asio::dispatch(who->strand,
+		[p, who, id]()
 		{
-			if (ec)
-			{
-				Log(ec.message());
-				u->lock.unlock();
-			}
-			else
-			{
-				u->lock.unlock();
-				ReadTransaction(u);
-			}
+			std::string name = who->name, info = who->InfoText();
+			boost::asio::dispatch(p->strand,
+				[p, id, name, info]()
+				{
+					Transaction reply(p.get(), 0, true, id, 0);
+					reply.AddString(F_USERNAME, name);
+					reply.AddString(F_DATA, info);
+					p->Send(reply.Encode(true));
+				});
 		});
 }
 
+void Server::HandleSetUserInfo(User *u, Transaction *trans)
+{
+	auto nick = trans->Find(F_USERNAME);
+	auto icon = trans->Find(F_USERICONID);
+	
+	if (nick) u->name = nick->AsText();
+	if (icon) u->icon = icon->AsInt16();
+	delete trans;
+	
+	user_list.Update(u);
+}
+
 void Server::HandleSendChat(User *u, Transaction *trans)
 {
 	using namespace boost::asio;
@@ -355,37 +563,485 @@ void Server::HandleSendChat(User *u, Transaction *trans)
 	std::string namestr = name_padding.str();
 	
 	//bool special = static_cast<bool>(trans->params[0]->AsInt16() & 1);
-	std::vector<uint8_t> msg = trans->params[0]->AsByteArray();
-	msg.insert(msg.begin(), namestr.begin(), namestr.end());
+	auto data = trans->Find(F_DATA);
+	std::vector<uint8_t> msg(namestr.begin(), namestr.end());
+	if (data) msg.insert(msg.end(), data->data, data->data+data->size);
 	msg.push_back('\r');
 	
 	delete trans;
-	trans = new Transaction(u, OP_CHATMSG, false, 0, 0);
-	trans->params.push_back(new ByteArrayParam(F_DATA, msg.data(), msg.size()));
-	trans->params.push_back(new Int16Param(F_USERID, u->id));
 	
-	for (auto p: users)
+	Transaction chat(u, OP_CHATMSG, false, 0, 0);
+	chat.AddBytes(F_DATA, msg.data(), std::min<size_t>(msg.size(), UINT16_MAX));
+	chat.AddInt16(F_USERID, u->id);
+	Broadcast(chat);
+}
+
+void Server::HandleNewUser(User *u, Transaction *trans)
+{
+	auto login = trans->Find(F_USERLOGIN);
+	auto password = trans->Find(F_USERPASSWORD);
+	auto nick = trans->Find(F_USERNAME);
+	auto access = trans->Find(F_USERACCESS);
+	
+	Account a;
+	if (login) a.login = ConvertString(std::string(login->AsString()));
+	if (nick) a.name = nick->AsText();
+	a.SetPassword(password ? ConvertString(std::string(password->AsString())) : "");
+	if (access) a.access = AccessFromWire(access->AsInt64());
+	delete trans;
+	
+	if (!u->access[UA_CREATEUSER])
+		SendError(u, "You are not allowed to create accounts.");
+	else if (a.login.empty())
+		SendError(u, "An account needs a login.");
+	else if (!accounts.Create(a))
+		SendError(u, "Cannot create account " + a.login + " because there is already an account with that login.");
+	else
 	{
-		std::ostringstream ss;
-		User *up = p.second;
-		trans->id = up->last_trans_id;
-		
-		trans->Write(ss);
-		if (u != up) up->lock.lock();
+		Log(u->name + " created account " + a.login);
+		Transaction reply(u, 0, true, u->last_trans_id, 0);
+		u->Send(reply.Encode(true));
+	}
+}
+
+void Server::HandleDeleteUser(User *u, Transaction *trans)
+{
+	auto login = trans->Find(F_USERLOGIN);
+	std::string l = login ? ConvertString(std::string(login->AsString())) : "";
+	delete trans;
+	
+	if (!u->access[UA_DELETEUSER])
+		SendError(u, "You are not allowed to delete accounts.");
+	else if (!accounts.Remove(l))
+		SendError(u, "No such account.");
+	else
+	{
+		Log(u->name + " deleted account " + l);
+		Transaction reply(u, 0, true, u->last_trans_id, 0);
+		u->Send(reply.Encode(true));
+	}
+}
+
+void Server::HandleGetUser(User *u, Transaction *trans)
+{
+	auto login = trans->Find(F_USERLOGIN);
+	std::string l = login ? ConvertString(std::string(login->AsString())) : "";
+	delete trans;
+	
+	if (!u->access[UA_OPENUSER])
+	{
+		SendError(u, "You are not allowed to view accounts.");
+		return;
+	}
+	
+	auto a = accounts.Find(l);
+	if (!a)
+	{
+		SendError(u, "No such account.");
+		return;
+	}
+	
+	// the password stays put, a single zero byte is how clients say "unchanged" when they send it back
+	static const uint8_t unchanged = 0;
+	
+	Transaction reply(u, 0, true, u->last_trans_id, 0);
+	reply.AddString(F_USERNAME, a->name);
+	reply.AddString(F_USERLOGIN, ConvertString(a->login));
+	reply.AddBytes(F_USERPASSWORD, &unchanged, 1);
+	reply.AddInt64(F_USERACCESS, AccessToWire(a->access));
+	u->Send(reply.Encode(true));
+}
+
+void Server::HandleSetUser(User *u, Transaction *trans)
+{
+	auto login = trans->Find(F_USERLOGIN);
+	auto password = trans->Find(F_USERPASSWORD);
+	auto nick = trans->Find(F_USERNAME);
+	auto access = trans->Find(F_USERACCESS);
+	
+	std::string l = login ? ConvertString(std::string(login->AsString())) : "";
+	auto old = u->access[UA_MODIFYUSER] ? accounts.Find(l) : nullptr;
+	
+	if (!u->access[UA_MODIFYUSER])
+		SendError(u, "You are not allowed to modify accounts.");
+	else if (!old)
+		SendError(u, "No such account.");
+	else
+	{
+		Account a = *old;
+		if (nick) a.name = nick->AsText();
+		if (password && !(password->size == 1 && password->data[0] == 0))
+			a.SetPassword(ConvertString(std::string(password->AsString())));
+		if (access) a.access = AccessFromWire(access->AsInt64());
 		
-		async_write(up->sock, buffer(ss.str(), ss.str().size()),
-			[this, u, up, p, trans](boost::system::error_code ec, size_t s)
-			{
-				if (ec)
+		if (!accounts.Update(a))
+			SendError(u, "Cannot save account " + l + ".");
+		else
+		{
+			Log(u->name + " modified account " + l);
+			Transaction reply(u, 0, true, u->last_trans_id, 0);
+			u->Send(reply.Encode(true));
+		}
+	}
+	
+	delete trans;
+}
+
+void Server::HandleGetFileNameList(User *u, Transaction *trans)
+{
+	std::string dir;
+	bool valid = DecodeFilePath(trans->Find(F_FILEPATH), dir);
+	delete trans;
+	
+	if (!valid)
+	{
+		SendError(u, "Cannot find that folder.");
+		return;
+	}
+	
+	// a folder that isn't cached is read on the file list's threads, and the reply comes from there
+	UserPtr p = u->shared_from_this();
+	uint32_t id = u->last_trans_id;
+	file_list.List(dir,
+		[this, p, id](bool found, const FileListCache::Listing &listing)
+		{
+			boost::asio::dispatch(p->strand,
+				[this, p, id, found, listing]()
+				{
+					if (!found)
+					{
+						SendError(p.get(), "Cannot find that folder.", id);
+						return;
+					}
+					
+					// like the user list, a header in front of a shared buffer
+					Transaction reply(p.get(), 0, true, id, 0);
+					p->Send(reply.Wrap(listing.fields, listing.count, true));
+				});
+		});
+}
+
+void Server::HandleGetFileInfo(User *u, Transaction *trans)
+{
+	auto name = trans->Find(F_FILENAME);
+	
+	std::string dir, file = name ? std::string(name->AsString()) : "";
+	bool valid = ValidFileName(file) && DecodeFilePath(trans->Find(F_FILEPATH), dir);
+	bool want_hashes = trans->Find(F_FILEHASHMD5) || trans->Find(F_FILEHASHSHA1);
+	delete trans;
+	
+	if (!valid)
+	{
+		SendError(u, "Invalid file path.");
+		return;
+	}
+	
+	struct stat st;
+	std::string path = JoinPath(JoinPath(config.files_path, dir), file);
+	if (stat(path.c_str(), &st) != 0 || !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode)))
+	{
+		SendError(u, "Cannot find " + file + ".");
+		return;
+	}
+	
+	auto reply = std::make_shared<Transaction>(u, 0, true, u->last_trans_id, 0);
+	auto mtime = std::chrono::system_clock::from_time_t(st.st_mtime);
+	char type[4] = { 'f', 'l', 'd', 'r' }, creator[4] = {};
+	if (S_ISREG(st.st_mode)) FileTypeCodes(file, type, creator);
+	
+	reply->AddString(F_FILENAME, file);
+	reply->AddString(F_FILETYPESTRING, S_ISDIR(st.st_mode) ? "Folder" : std::string_view(type, 4));
+	reply->AddString(F_FILECREATORSTRING, std::string_view(creator, 4));
+	reply->AddBytes(F_FILETYPE, reinterpret_cast<uint8_t*>(type), 4);
+	reply->AddTime(F_FILECREATEDATE, mtime);
+	reply->AddTime(F_FILEMODIFYDATE, mtime);
+	if (S_ISREG(st.st_mode)) reply->AddInt32(F_FILESIZE, std::min<uint64_t>(st.st_size, UINT32_MAX));
+	
+	if (!want_hashes || !hashes || !S_ISREG(st.st_mode) || !u->extra_access[XA_FILEHASH])
+	{
+		u->Send(reply->Encode(true));
+		return;
+	}
+	
+	// a file that's never been hashed is read first, which can take a while, so the reply waits
+	// on the hash pool rather than holding up the session
+	UserPtr p = u->shared_from_this();
+	hashes->Hash(path,
+		[p, reply](bool ok, const FileHashes &h)
+		{
+			boost::asio::dispatch(p->strand,
+				[p, reply, ok, h]()
 				{
-					Log(ec.message());
-					up->lock.unlock();
-				}
-				else
-					up->lock.unlock();
-				
-				if (p == *users.end()) delete trans;
-				if (!ec && (u == up)) ReadTransaction(u);
-			});
+					if (ok)
+					{
+						reply->AddBytes(F_FILEHASHMD5, h.md5, sizeof(h.md5));
+						reply->AddBytes(F_FILEHASHSHA1, h.sha1, sizeof(h.sha1));
+					}
+					p->Send(reply->Encode(true));
+				});
+		});
+}
+
+void Server::HandleSearchFiles(User *u, Transaction *trans)
+{
+	auto text = trans->Find(F_FILENAME);
+	auto options = trans->Find(F_OPTIONS);
+	auto type = trans->Find(F_FILETYPE);
+	auto creator = trans->Find(F_FILECREATORSTRING);
+	auto size = trans->Find(F_FILESIZE);
+	
+	// the text, or the codes or a minimum size on their own
+	FileIndex::Query q;
+	if (text) q.text = text->AsText();
+	q.prefix = options && (options->AsInt32() & SEARCH_PREFIX);
+	if (type) q.type = type->AsInt32();
+	if (creator && creator->size == 4) q.creator = load_big_u32(creator->data);
+	if (size) q.min_size = size->AsInt32();
+	delete trans;
+	
+	if (!index)
+	{
+		SendError(u, "File search is not available.");
+		return;
 	}
+	if (q.text.empty() && !q.type && !q.creator && !q.min_size)
+	{
+		SendError(u, "Nothing to search for.");
+		return;
+	}
+	
+	// each hit is a listing record followed by the path of the folder it's in
+	auto fields = std::make_shared<std::vector<uint8_t>>();
+	uint16_t hits = index->Search(q, *fields);
+	
+	Transaction reply(u, 0, true, u->last_trans_id, 0);
+	u->Send(reply.Wrap(fields, hits*2, true));
+}
+
+void Server::HandleIndexStatus(User *u, Transaction *trans)
+{
+	delete trans;
+	
+	if (!index)
+	{
+		SendError(u, "File search is not available.");
+		return;
+	}
+	
+	// the items indexed so far, and the folders still to read; none once the index is complete
+	auto p = index->Status();
+	Transaction reply(u, 0, true, u->last_trans_id, 0);
+	reply.AddInt32(F_FLDRITEMCOUNT, p.items);
+	reply.AddInt32(F_WAITINGCOUNT, p.folders_left);
+	u->Send(reply.Encode(true));
+}
+
+void Server::HandleDownloadFile(User *u, Transaction *trans)
+{
+	auto name = trans->Find(F_FILENAME);
+	auto resume = trans->Find(F_FILERESUMEDATA);
+	
+	std::string dir, file = name ? std::string(name->AsString()) : "";
+	uint64_t offset = 0;
+	bool valid = ValidFileName(file) && DecodeFilePath(trans->Find(F_FILEPATH), dir) &&
+		(!resume || ResumeOffset(*resume, offset));
+	delete trans;
+	
+	if (!u->access[UA_DOWNLOADFILE])
+	{
+		SendError(u, "You are not allowed to download files.");
+		return;
+	}
+	if (!valid)
+	{
+		SendError(u, "Invalid file path.");
+		return;
+	}
+	
+	struct stat st;
+	int fd = open(JoinPath(JoinPath(config.files_path, dir), file).c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+	{
+		if (fd >= 0) close(fd);
+		SendError(u, "Cannot find " + file + ".");
+		return;
+	}
+	
+	// a resume from past the end just gets the headers
+	offset = std::min<uint64_t>(offset, st.st_size);
+	uint64_t left = st.st_size-offset;
+	auto mtime = std::chrono::system_clock::from_time_t(st.st_mtime);
+	std::unique_ptr<Download> d(new Download(fd, offset, left, FlattenFileHeader(file, mtime, mtime, left)));
+	
+	// sizes are 32 bits on the wire
+	uint64_t size = d->header.size()+left;
+	if (size > UINT32_MAX)
+	{
+		SendError(u, file + " is too large to download.");
+		return;
+	}
+	
+	uint32_t refnum = transfers.Offer(std::move(d));
+	Log(u->name + " is downloading " + JoinPath(dir, file));
+	
+	Transaction reply(u, 0, true, u->last_trans_id, 0);
+	reply.AddInt32(F_TRANSFERSIZE, size);
+	reply.AddInt32(F_FILESIZE, st.st_size);
+	reply.AddInt32(F_REFNUM, refnum);
+	reply.AddInt16(F_WAITINGCOUNT, 0);
+	u->Send(reply.Encode(true));
+}
+
+void Server::HandleDownloadFolder(User *u, Transaction *trans)
+{
+	auto name = trans->Find(F_FILENAME);
+	
+	std::string dir, folder = name ? std::string(name->AsString()) : "";
+	bool valid = ValidFileName(folder) && DecodeFilePath(trans->Find(F_FILEPATH), dir);
+	delete trans;
+	
+	if (!u->access[UA_DOWNLOADFOLDER])
+	{
+		SendError(u, "You are not allowed to download folders.");
+		return;
+	}
+	if (!valid)
+	{
+		SendError(u, "Invalid file path.");
+		return;
+	}
+	
+	struct stat st;
+	std::string path = JoinPath(JoinPath(config.files_path, dir), folder);
+	if (stat(path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+	{
+		SendError(u, "Cannot find " + folder + ".");
+		return;
+	}
+	
+	Log(u->name + " is downloading the folder " + JoinPath(dir, folder));
+	
+	// the reply waits for the whole tree to be counted, which mustn't hold up the rest of the session
+	UserPtr p = u->shared_from_this();
+	uint32_t id = u->last_trans_id;
+	transfers.Offer(path,
+		[p, id](uint32_t refnum, uint64_t size, uint32_t items)
+		{
+			boost::asio::dispatch(p->strand,
+				[p, id, refnum, size, items]()
+				{
+					Transaction reply(p.get(), 0, true, id, 0);
+					reply.AddInt32(F_TRANSFERSIZE, std::min<uint64_t>(size, UINT32_MAX));
+					reply.AddInt16(F_FLDRITEMCOUNT, std::min<uint32_t>(items, UINT16_MAX));
+					reply.AddInt32(F_REFNUM, refnum);
+					reply.AddInt16(F_WAITINGCOUNT, 0);
+					p->Send(reply.Encode(true));
+				});
+		});
+}
+
+void Server::HandleUploadFile(User *u, Transaction *trans)
+{
+	auto name = trans->Find(F_FILENAME);
+	auto options = trans->Find(F_FILEXFEROPTIONS);
+	
+	std::string dir, file = name ? std::string(name->AsString()) : "";
+	bool valid = ValidFileName(file) && DecodeFilePath(trans->Find(F_FILEPATH), dir);
+	bool resume = options && options->AsInt32() == 1;
+	delete trans;
+	
+	if (!u->access[UA_UPLOADFILE])
+	{
+		SendError(u, "You are not allowed to upload files.");
+		return;
+	}
+	if (!valid)
+	{
+		SendError(u, "Invalid file path.");
+		return;
+	}
+	
+	struct stat st;
+	std::string folder = JoinPath(config.files_path, dir), path = JoinPath(folder, file);
+	if (stat(folder.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+	{
+		SendError(u, "Cannot find the folder to upload " + file + " to.");
+		return;
+	}
+	if (stat(path.c_str(), &st) == 0)
+	{
+		SendError(u, "Cannot accept upload because there is already a file named " + file + ".");
+		return;
+	}
+	
+	uint64_t offset = resume && stat((path+".hpf").c_str(), &st) == 0 ? st.st_size : 0;
+	uint32_t refnum = transfers.Offer(std::unique_ptr<Upload>(new Upload { folder, file, offset, 0 }));
+	Log(u->name + " is uploading " + JoinPath(dir, file));
+	
+	Transaction reply(u, 0, true, u->last_trans_id, 0);
+	reply.AddInt32(F_REFNUM, refnum);
+	if (resume)
+	{
+		auto r = ResumeData(offset);
+		reply.AddBytes(F_FILERESUMEDATA, r.data(), r.size());
+	}
+	u->Send(reply.Encode(true));
+}
+
+void Server::HandleUploadFolder(User *u, Transaction *trans)
+{
+	auto name = trans->Find(F_FILENAME);
+	auto items = trans->Find(F_FLDRITEMCOUNT);
+	
+	std::string dir, folder = name ? std::string(name->AsString()) : "";
+	bool valid = ValidFileName(folder) && DecodeFilePath(trans->Find(F_FILEPATH), dir);
+	uint16_t count = items ? items->AsInt16() : 0;
+	delete trans;
+	
+	if (!u->access[UA_UPLOADFOLDER])
+	{
+		SendError(u, "You are not allowed to upload folders.");
+		return;
+	}
+	if (!valid)
+	{
+		SendError(u, "Invalid file path.");
+		return;
+	}
+	
+	// an existing folder is fine, whatever's already in it is skipped or resumed
+	std::string path = JoinPath(JoinPath(config.files_path, dir), folder);
+	if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST)
+	{
+		SendError(u, "Cannot create the folder " + folder + ".");
+		return;
+	}
+	
+	uint32_t refnum = transfers.Offer(std::unique_ptr<Upload>(new Upload { path, "", 0, count }));
+	Log(u->name + " is uploading the folder " + JoinPath(dir, folder));
+	
+	Transaction reply(u, 0, true, u->last_trans_id, 0);
+	reply.AddInt32(F_REFNUM, refnum);
+	u->Send(reply.Encode(true));
+}
+
+void Server::SendError(User *u, const std::string &msg)
+{
+	SendError(u, msg, u->last_trans_id);
+}
+
+void Server::SendError(User *u, const std::string &msg, uint32_t id)
+{
+	Transaction reply(u, 0, true, id, 1);
+	reply.AddString(F_ERRORTEXT, msg);
+	u->Send(reply.Encode(true));
+}
+
+void Server::Broadcast(const Transaction &trans)
+{
+	// encode once, then only the transaction ID differs between recipients
+	Frame frame = trans.Share();
+	
+	for (auto &u: *users.Live())
+		u->Send(frame, SP_LOW, true);
 }
@@ -1,310 +1,305 @@
 #include <boost/endian/conversion.hpp>
 #include <boost/predef.h>
-#include <iostream>
-#include <stdexcept>
 
 #include "transactions.hpp"
 #include "users.hpp"
 
-void Parameter::Write(std::ostream &s) const
+ParamKind FieldKind(uint16_t type)
 {
-	s.write(reinterpret_cast<const char*>(&type), 2);
+	switch (type)
+	{
+		case F_USERICONID:
+		case F_CHATOPTIONS:
+		case F_USERFLAGS:
+		case F_OPTIONS:
+		case F_VERS:
+		case F_USERID:
+		case F_FILESIZE:
+		case F_FILETYPE:
+		case F_USERACCESS:
+		case F_REFNUM:
+		case F_TRANSFERSIZE:
+		case F_CHATID:
+		case F_WAITINGCOUNT:
+		case F_NOSERVERAGREEMENT:
+		case F_COMMUNITYBANNERID:
+		case F_SERVERBANNERTYPE:
+		case F_FLDRITEMCOUNT:
+		case F_FILEXFEROPTIONS:
+		case F_NEWSARTID:
+			return PK_INTEGER;
+		case F_ERRORTEXT:
+		case F_USERNAME:
+		case F_USERLOGIN:
+		case F_CHATSUBJECT:
+		case F_SERVERNAME:
+		case F_SERVERBANNERURL:
+		case F_FILENAME:
+		case F_FILETYPESTRING:
+		case F_FILECREATORSTRING:
+		case F_FILECOMMENT:
+		case F_FILENEWNAME:
+		case F_AUTOMATICRESPONSE:
+		case F_NEWSCATNAME:
+		case F_NEWSARTDATAFLAV:
+		case F_NEWSARTTITLE:
+		case F_NEWSARTPOSTER:
+		case F_NEWSARTDATA:
+			return PK_STRING;
+		case F_DATA:
+		case F_USERPASSWORD:
+		case F_NEWSCATGUID:
+		case F_SERVERAGREEMENT:
+		case F_SERVERBANNER:
+		case F_FILEPATH:
+		case F_FILERESUMEDATA:
+		case F_FILENEWPATH:
+		case F_QUOTINGMSG:
+		case F_NEWSPATH:
+		case F_FILEHASHMD5:
+		case F_FILEHASHSHA1:
+			return PK_BYTES;
+		case F_FILECREATEDATE:
+		case F_FILEMODIFYDATE:
+		case F_NEWSARTDATE:
+			return PK_TIME;
+		case F_USERNAMEWITHINFO:
+			return PK_USERINFO;
+		default:
+			return PK_UNKNOWN;
+	}
 }
 
-uint16_t Parameter::AsInt16() const
+uint16_t ParamView::AsInt16() const
 {
-	return 0;
+	return size >= 2 ? boost::endian::load_big_u16(data) : 0;
 }
 
-uint32_t Parameter::AsInt32() const
+uint32_t ParamView::AsInt32() const
 {
-	return 0;
+	// clients are free to shrink integer fields to 16 bits
+	if (size >= 4) return boost::endian::load_big_u32(data);
+	return AsInt16();
 }
 
-uint64_t Parameter::AsInt64() const
+uint64_t ParamView::AsInt64() const
 {
-	return 0;
+	if (size >= 8) return boost::endian::load_big_u64(data);
+	return AsInt32();
 }
 
-std::string Parameter::AsString() const
+std::string_view ParamView::AsString() const
 {
-	return "";
+	return std::string_view(reinterpret_cast<const char*>(data), size);
 }
 
-std::vector<uint8_t> Parameter::AsByteArray() const
+std::string ParamView::AsText() const
 {
-	return std::vector<uint8_t>();
+#if BOOST_OS_UNIX
+	return CR2LF(std::string(AsString()));
+#else
+	return std::string(AsString());
+#endif // BOOST_OS_UNIX
 }
 
-std::chrono::system_clock::time_point Parameter::AsTime() const
+std::chrono::system_clock::time_point ParamView::AsTime() const
 {
-	return std::chrono::system_clock::now();
+	if (size < 8) return std::chrono::system_clock::now();
+	return DateTime(data).TimePoint();
 }
 
-void Int16Param::Write(std::ostream &s) const
+Transaction::Transaction(User *user, const uint8_t *header):
+	payload(nullptr),
+	payload_size(0)
 {
-	big_uint16_t size = GetSize();
+	using namespace boost::endian;
 	
-	Parameter::Write(s);
-	s.write(reinterpret_cast<const char*>(&size), 2);
-	s.write(reinterpret_cast<const char*>(&ordinal), 2);
-}
-
-uint16_t Int16Param::GetSize() const
-{
-	return 2;
-}
-
-uint16_t Int16Param::AsInt16() const
-{
-	return ordinal;
-}
-
-void Int32Param::Write(std::ostream &s) const
-{
-	big_uint16_t size = GetSize();
+	// header[0] is reserved
+	reply = static_cast<bool>(header[1]);
+	type = load_big_u16(header+2);
+	id = load_big_u32(header+4);
+	error = load_big_u32(header+8);
+	size = load_big_u32(header+12);
+	// header+16 is the total size, which is the same as ours as we don't do multipart
 	
-	Parameter::Write(s);
-	s.write(reinterpret_cast<const char*>(&size), 2);
-	s.write(reinterpret_cast<const char*>(&ordinal), 4);
+	this->user = user;
+	user->last_trans_id = id;
 }
 
-uint16_t Int32Param::GetSize() const
+bool Transaction::ReadParams(const uint8_t *data, uint32_t len)
 {
-	return 4;
+	using namespace boost::endian;
+	
+	params.clear();
+	payload = data+std::min<uint32_t>(len, 2);
+	payload_size = len-std::min<uint32_t>(len, 2);
+	
+	if (len < 2) return len == 0;
+	
+	uint16_t nparams = load_big_u16(data);
+	const uint8_t *p = payload, *end = payload+payload_size;
+	
+	params.reserve(nparams);
+	
+	while (nparams--)
+	{
+		if (end-p < 4) return false;
+		
+		Parameter param;
+		param.type = load_big_u16(p);
+		param.size = load_big_u16(p+2);
+		param.offset = p+4-payload;
+		param.kind = FieldKind(param.type);
+		p += 4;
+		
+		if (end-p < param.size) return false;
+		
+		params.push_back(param);
+		p += param.size;
+	}
+	
+	return true;
 }
 
-uint32_t Int32Param::AsInt32() const
+std::optional<ParamView> Transaction::Find(uint16_t type) const
 {
-	return ordinal;
+	for (size_t i = 0; i < params.size(); i++)
+		if (params[i].type == type) return (*this)[i];
+	return std::nullopt;
 }
 
-void Int64Param::Write(std::ostream &s) const
+uint8_t* Transaction::AddField(uint16_t type, uint16_t size, ParamKind kind)
 {
-	big_uint16_t size = GetSize();
+	size_t at = storage.size();
 	
-	Parameter::Write(s);
-	s.write(reinterpret_cast<const char*>(&size), 2);
-	s.write(reinterpret_cast<const char*>(&ordinal), 8);
-}
-
-uint16_t Int64Param::GetSize() const
-{
-	return 8;
+	storage.resize(at+4+size);
+	boost::endian::store_big_u16(&storage[at], type);
+	boost::endian::store_big_u16(&storage[at+2], size);
+	params.push_back(Parameter { type, size, static_cast<uint32_t>(at+4), kind });
+	
+	return &storage[at+4];
 }
 
-uint64_t Int64Param::AsInt64() const
+void Transaction::AddInt16(uint16_t type, uint16_t i)
 {
-	return ordinal;
+	boost::endian::store_big_u16(AddField(type, 2, PK_INTEGER), i);
 }
 
-void StringParam::Write(std::ostream &s) const
+void Transaction::AddInt32(uint16_t type, uint32_t i)
 {
-	big_uint16_t size = GetSize();
-	std::string str = LF2CR(std::string(text));
-	
-	Parameter::Write(s);
-	s.write(reinterpret_cast<const char*>(&size), 2);
-	s.write(str.data(), GetSize());
+	boost::endian::store_big_u32(AddField(type, 4, PK_INTEGER), i);
 }
 
-uint16_t StringParam::GetSize() const
+void Transaction::AddInt64(uint16_t type, uint64_t i)
 {
-	return text.size();
+	boost::endian::store_big_u64(AddField(type, 8, PK_INTEGER), i);
 }
 
-std::string StringParam::AsString() const
+void Transaction::AddString(uint16_t type, std::string_view s)
 {
-#if BOOST_OS_UNIX
-	std::string str = CR2LF(std::string(text));
-#endif // BOOST_OS_UNIX
-	return str;
+	uint16_t len = std::min<size_t>(s.size(), UINT16_MAX);
+	uint8_t *p = AddField(type, len, PK_STRING);
+	
+	for (uint16_t i = 0; i < len; i++)
+		p[i] = s[i] == '\n' ? '\r' : s[i];
 }
 
-void ByteArrayParam::Write(std::ostream &s) const
+void Transaction::AddBytes(uint16_t type, const uint8_t *b, uint16_t len)
 {
-	big_uint16_t size = GetSize();
-	Parameter::Write(s);
-	s.write(reinterpret_cast<const char*>(&size), 2);
-	s.write(reinterpret_cast<const char*>(&bytes[0]), size);
+	std::copy(b, b+len, AddField(type, len, PK_BYTES));
 }
 
-uint16_t ByteArrayParam::GetSize() const
+void Transaction::AddTime(uint16_t type, const std::chrono::system_clock::time_point &tp)
 {
-	return bytes.size();
+	DateTime(tp).Write(AddField(type, 8, PK_TIME));
 }
 
-std::vector<uint8_t> ByteArrayParam::AsByteArray() const
+uint16_t UserInfoSize(const User *u)
 {
-	return bytes;
+	return std::min<size_t>(u->name.size(), UINT16_MAX-8)+8;
 }
 
-void TimeParam::Write(std::ostream &s) const
+void EncodeUserInfo(const User *u, uint8_t *p)
 {
-	big_uint16_t size = GetSize();
+	using namespace boost::endian;
+	
+	uint16_t nlen = UserInfoSize(u)-8;
 	
-	Parameter::Write(s);
-	s.write(reinterpret_cast<const char*>(&size), 2);
-	dt.Write(s);
+	store_big_u16(p, u->id);
+	store_big_u16(p+2, u->icon);
+	store_big_u16(p+4, 0); // TODO: chat flags
+	store_big_u16(p+6, nlen);
+	std::copy(u->name.begin(), u->name.begin()+nlen, p+8);
 }
 
-uint16_t TimeParam::GetSize() const
+void Transaction::AddUserInfo(const User *u)
 {
-	return 8;
+	EncodeUserInfo(u, AddField(F_USERNAMEWITHINFO, UserInfoSize(u), PK_USERINFO));
 }
 
-std::chrono::system_clock::time_point TimeParam::AsTime() const
+uint32_t Transaction::GetSize() const
 {
-	return dt.TimePoint();
+	return PayloadSize()+2; // always count uint16(# of params)
 }
 
-UserInfoParam::UserInfoParam(User *u): Parameter(F_USERNAMEWITHINFO)
+void Transaction::Stamp(bool preserve_id)
 {
-	id = u->id;
-	icon = u->icon;
-	flags = 0; // TODO: chat flags
-	name = new char[u->name.size()];
-	std::copy(u->name.begin(), u->name.end(), name);
+	if (reply)
+		++user->nreplies;
+	if (!preserve_id)
+		id = ++user->last_trans_id;
 }
 
-void UserInfoParam::Write(std::ostream &s) const
+void Transaction::EncodeHeader(uint8_t *p, uint32_t size, uint16_t nparams) const
 {
-	big_uint16_t size = GetSize();
-	big_uint16_t nlen = strlen(name);
+	using namespace boost::endian;
 	
-	Parameter::Write(s);
-	s.write(reinterpret_cast<const char*>(&size), 2);
-	s.write(reinterpret_cast<const char*>(&id), 2);
-	s.write(reinterpret_cast<const char*>(&icon), 2);
-	s.write(reinterpret_cast<const char*>(&flags), 2);
-	s.write(reinterpret_cast<const char*>(&nlen), 2);
-	s.write(name, nlen);
+	p[0] = 0; // reserved
+	p[1] = static_cast<uint8_t>(reply);
+	store_big_u16(p+2, reply ? 0 : static_cast<uint16_t>(type));
+	store_big_u32(p+4, id);
+	store_big_u32(p+8, error);
+	store_big_u32(p+12, size); // this data
+	store_big_u32(p+16, size); // total data (this data again)
+	store_big_u16(p+20, nparams);
 }
 
-uint16_t UserInfoParam::GetSize() const
+void Transaction::Write(std::vector<uint8_t> &out, bool preserve_id)
 {
-	return strlen(name)+8;
-}
-
-Transaction::Transaction(User *user, std::istream &s)
-{
-	s.ignore(1); // reserved
-	reply = static_cast<bool>(s.get());
-	s.read(reinterpret_cast<char*>(&type), 2);
-	s.read(reinterpret_cast<char*>(&id), 4);
-	s.read(reinterpret_cast<char*>(&error), 4);
-	s.read(reinterpret_cast<char*>(&size), 4);
-	s.ignore(4); // duplicate size
+	uint32_t size = GetSize();
+	size_t at = out.size();
 	
-	this->user = user;
-	user->last_trans_id = id;
+	Stamp(preserve_id);
+	out.resize(at+TRANSACTION_HEADER_SIZE+size);
+	EncodeHeader(&out[at], size, params.size());
+	std::copy(Payload(), Payload()+PayloadSize(), &out[at+PAYLOAD_OFFSET]);
 }
 
-void Transaction::ReadParams(std::istream &s)
+Frame Transaction::Share() const
 {
-	using namespace boost::endian;
-	
-	uint16_t nparams;
+	Frame f;
 	
-	s.read(reinterpret_cast<char*>(&nparams), 2);
-	big_to_native_inplace(nparams);
-	
-	if (nparams > 0)
-	{
-		while (nparams--)
-		{
-			big_uint16_t pid;
-			s.read(reinterpret_cast<char*>(&pid), 2);
-			s.seekg(-2, s.cur);
-			
-			try
-			{
-				switch (pid)
-				{
-					case F_USERICONID:
-					case F_CHATOPTIONS:
-					case F_USERFLAGS:
-					case F_OPTIONS:
-					case F_VERS:
-					case F_USERID:
-						params.push_back(new Int16Param(s));
-						break;
-					case F_FILESIZE:
-					case F_FILETYPE:
-						params.push_back(new Int32Param(s));
-						break;
-					case F_USERACCESS:
-						params.push_back(new Int64Param(s));
-						break;
-					case F_USERNAME:
-					case F_USERLOGIN:
-					case F_CHATSUBJECT:
-					case F_FILENAME:
-					case F_FILETYPESTRING:
-					case F_FILECREATORSTRING:
-					case F_FILECOMMENT:
-					case F_FILENEWNAME:
-					case F_AUTOMATICRESPONSE:
-					case F_NEWSCATNAME:
-					case F_NEWSARTDATAFLAV:
-					case F_NEWSARTTITLE:
-					case F_NEWSARTPOSTER:
-					case F_NEWSARTDATA:
-						params.push_back(new StringParam(s));
-						break;
-					case F_DATA:
-					case F_USERPASSWORD:
-					case F_NEWSCATGUID:
-						params.push_back(new ByteArrayParam(s));
-						break;
-					case F_FILECREATEDATE:
-					case F_FILEMODIFYDATE:
-					case F_NEWSARTDATE:
-						params.push_back(new TimeParam(s));
-						break;
-					default:
-						throw std::runtime_error("[Transaction]: Unknown parameter encountered");
-				}
-			}
-			catch (std::runtime_error &e)
-			{
-				std::cerr << e.what() << '\n';
-			}
-		}
-	}
+	// one copy, on purpose: the fields live inline in a pooled transaction that's gone long before
+	// the frame is written, and anything big enough for the copy to matter comes through Wrap
+	EncodeHeader(f.header, GetSize(), params.size());
+	auto buf = BufferPool::Get(PayloadSize());
+	std::copy(Payload(), Payload()+PayloadSize(), buf->begin());
+	f.payload = buf;
+	return f;
 }
 
-uint32_t Transaction::GetSize() const
+Frame Transaction::Encode(bool preserve_id)
 {
-	uint32_t len = 2; // always count uint16(# of params)
-	
-	for (auto p: params)
-		len += p->GetSize()+4;
-	return len;
+	Stamp(preserve_id);
+	return Share();
 }
 
-void Transaction::Write(std::ostream &s, bool preserve_id)
+Frame Transaction::Wrap(const std::shared_ptr<const std::vector<uint8_t>> &fields, uint16_t nparams, bool preserve_id)
 {
-	big_uint32_t size = GetSize();
-	big_uint16_t nparams = params.size();
-	
-	s.put(0); // reserved
-	s.put(static_cast<char>(reply));
-	
-	if (reply)
-		s.put(0).put(0);
-	else
-		s.write(reinterpret_cast<const char*>(&type), 2);
-	
-	if (reply)
-		++user->nreplies;
-	if (!preserve_id)
-		id = ++user->last_trans_id;
+	Frame f;
 	
-	s.write(reinterpret_cast<const char*>(&id), 4);
-	s.write(reinterpret_cast<const char*>(&error), 4);
-	s.write(reinterpret_cast<const char*>(&size), 4); // this data
-	s.write(reinterpret_cast<const char*>(&size), 4); // total data (this data again)
-	s.write(reinterpret_cast<const char*>(&nparams), 2);
-	for (auto p: params) p->Write(s);
+	Stamp(preserve_id);
+	EncodeHeader(f.header, fields->size()+2, nparams);
+	f.payload = fields;
+	return f;
 }
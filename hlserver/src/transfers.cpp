@@ -0,0 +1,845 @@
+#include <boost/endian/conversion.hpp>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/rand.h>
+#include <stdexcept>
+#include <sys/file.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "files.hpp"
+#include "metrics.hpp"
+#include "transfers.hpp"
+
+Download::~Download()
+{
+	close(fd);
+}
+
+FolderWalk::FolderWalk(const std::string &root)
+{
+	if (DIR *d = opendir(root.c_str())) open.emplace_back(d, "");
+}
+
+FolderWalk::~FolderWalk()
+{
+	for (auto &d: open) closedir(d.first);
+}
+
+bool FolderWalk::Next(Item &item)
+{
+	while (!open.empty())
+	{
+		DIR *d = open.back().first;
+		struct dirent *e = readdir(d);
+		if (!e)
+		{
+			closedir(d);
+			open.pop_back();
+			continue;
+		}
+		
+		std::string_view name(e->d_name);
+		if (name == "." || name == ".." || HiddenFile(name) || !ValidFileName(name)) continue;
+		if (fstatat(dirfd(d), e->d_name, &item.st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+		
+		// links are followed to files, but not to folders, which could lead back up the tree
+		if (S_ISLNK(item.st.st_mode) && (fstatat(dirfd(d), e->d_name, &item.st, 0) != 0 || !S_ISREG(item.st.st_mode)))
+			continue;
+		if (!S_ISREG(item.st.st_mode) && !S_ISDIR(item.st.st_mode)) continue;
+		
+		item.rel = JoinPath(open.back().second, name);
+		item.folder = S_ISDIR(item.st.st_mode);
+		
+		// an unreadable folder is still sent, just empty
+		if (item.folder)
+		{
+			int fd = openat(dirfd(d), e->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			DIR *sub = fd >= 0 ? fdopendir(fd) : nullptr;
+			if (sub)
+				open.emplace_back(sub, item.rel);
+			else if (fd >= 0)
+				close(fd);
+		}
+		
+		return true;
+	}
+	
+	return false;
+}
+
+// A file goes in a folder download if its flattened form has a size that fits the 32 bits on the wire
+static bool Sendable(const FolderWalk::Item &item)
+{
+	std::string_view rel(item.rel);
+	size_t name = std::min<size_t>(rel.size()-rel.rfind('/')-1, UINT8_MAX);
+	return item.folder ||
+		uint64_t(item.st.st_size) <= UINT32_MAX-(FILE_HEADER_SIZE+2*FORK_HEADER_SIZE+INFO_FORK_SIZE+name);
+}
+
+std::vector<uint8_t> FlattenFileHeader(std::string_view name, const std::chrono::system_clock::time_point &created,
+	const std::chrono::system_clock::time_point &modified, uint64_t data_size)
+{
+	using namespace boost::endian;
+	
+	name = name.substr(0, UINT8_MAX);
+	std::vector<uint8_t> h(FILE_HEADER_SIZE+FORK_HEADER_SIZE+INFO_FORK_SIZE+name.size()+FORK_HEADER_SIZE, 0);
+	uint8_t *p = h.data();
+	
+	std::memcpy(p, "FILP", 4);
+	store_big_u16(p+4, 1); // version
+	store_big_u16(p+22, 2); // forks
+	p += FILE_HEADER_SIZE;
+	
+	std::memcpy(p, "INFO", 4);
+	store_big_u32(p+12, INFO_FORK_SIZE+name.size());
+	p += FORK_HEADER_SIZE;
+	
+	// flags and the reserved space stay zero, and so does the comment length at the end
+	std::memcpy(p, "AMAC", 4);
+	FileTypeCodes(name, reinterpret_cast<char*>(p+4), reinterpret_cast<char*>(p+8));
+	DateTime(created).Write(p+52);
+	DateTime(modified).Write(p+60);
+	store_big_u16(p+70, name.size());
+	std::memcpy(p+72, name.data(), name.size());
+	p += INFO_FORK_SIZE+name.size();
+	
+	std::memcpy(p, "DATA", 4);
+	store_big_u32(p+12, data_size);
+	
+	return h;
+}
+
+bool ResumeOffset(const ParamView &v, uint64_t &offset)
+{
+	// 'RFLT', version, reserved, fork count, then (fork type, size so far, reserved) per fork
+	if (v.size < RESUME_HEADER_SIZE || std::memcmp(v.data, "RFLT", 4) != 0) return false;
+	
+	uint16_t forks = boost::endian::load_big_u16(v.data+40);
+	if (v.size < RESUME_HEADER_SIZE+forks*16) return false;
+	
+	offset = 0;
+	for (const uint8_t *p = v.data+RESUME_HEADER_SIZE; forks--; p += 16)
+		if (std::memcmp(p, "DATA", 4) == 0) offset = boost::endian::load_big_u32(p+4);
+	
+	return true;
+}
+
+std::vector<uint8_t> ResumeData(uint64_t offset)
+{
+	std::vector<uint8_t> r(RESUME_HEADER_SIZE+16, 0);
+	std::memcpy(r.data(), "RFLT", 4);
+	boost::endian::store_big_u16(r.data()+4, 1); // version
+	boost::endian::store_big_u16(r.data()+40, 1); // forks
+	std::memcpy(r.data()+RESUME_HEADER_SIZE, "DATA", 4);
+	boost::endian::store_big_u32(r.data()+RESUME_HEADER_SIZE+4, offset);
+	return r;
+}
+
+TransferServer::TransferServer(uint16_t port, unsigned nthreads, SyncPolicy sync, uint64_t sync_interval):
+	work(new boost::asio::io_service::work(io)),
+	listener(io),
+	counting_work(new boost::asio::io_service::work(counting)),
+	sync(sync),
+	sync_interval(sync_interval)
+{
+	tcp::endpoint ep(tcp::v4(), port);
+	listener.open(ep.protocol());
+	listener.set_option(tcp::acceptor::reuse_address(true));
+	listener.bind(ep);
+	listener.listen();
+	Listen();
+	
+	for (unsigned i = 0; i < std::max(1u, nthreads); i++)
+		threads.create_thread([this]() { io.run(); });
+	for (unsigned i = 0; i < FOLDER_COUNT_THREADS; i++)
+		counters.create_thread([this]() { counting.run(); });
+}
+
+TransferServer::~TransferServer()
+{
+	// a walk that's under way gives up once it sees this
+	counting_work.reset();
+	counting.stop();
+	counters.join_all();
+	
+	work.reset();
+	io.stop();
+	threads.join_all();
+}
+
+uint32_t TransferServer::Offer(std::unique_ptr<Download> d)
+{
+	Ticket t;
+	t.download = std::move(d);
+	return Offer(std::move(t));
+}
+
+uint32_t TransferServer::Offer(std::unique_ptr<Upload> u)
+{
+	Ticket t;
+	t.upload = std::move(u);
+	return Offer(std::move(t));
+}
+
+void TransferServer::Offer(const std::string &folder, FolderOffered cb)
+{
+	boost::asio::post(counting,
+		[this, folder, cb]()
+		{
+			// everything the client will read: per item a header, and per file its size and flattened form
+			FolderWalk walk(folder);
+			FolderWalk::Item item;
+			std::vector<uint8_t> path;
+			uint64_t size = 0;
+			uint32_t items = 0;
+			
+			while (walk.Next(item))
+			{
+				if (counting.stopped()) return;
+				if (!Sendable(item)) continue;
+				
+				path.clear();
+				EncodeFilePath(path, item.rel);
+				size += 4+path.size();
+				if (!item.folder)
+				{
+					std::string_view name(item.rel);
+					name.remove_prefix(name.rfind('/')+1);
+					size += 4+FILE_HEADER_SIZE+2*FORK_HEADER_SIZE+INFO_FORK_SIZE+std::min<size_t>(name.size(), UINT8_MAX);
+					size += item.st.st_size;
+				}
+				items++;
+			}
+			
+			Ticket t;
+			t.folder.reset(new FolderDownload(folder));
+			cb(Offer(std::move(t)), size, items);
+		});
+}
+
+uint32_t TransferServer::Offer(Ticket &&ticket)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	
+	// whoever holds the number gets the file, so it mustn't be guessable
+	uint32_t refnum;
+	do
+	{
+		if (RAND_bytes(reinterpret_cast<uint8_t*>(&refnum), sizeof(refnum)) != 1)
+			throw std::runtime_error("[Transfers]: No randomness for a reference number");
+	}
+	while (!refnum || tickets.count(refnum));
+	
+	Ticket &t = tickets[refnum];
+	t = std::move(ticket);
+	t.expiry.reset(new boost::asio::steady_timer(io, TRANSFER_TTL));
+	t.expiry->async_wait(
+		[this, refnum](boost::system::error_code ec)
+		{
+			if (ec) return; // claimed in time
+			
+			std::lock_guard<std::mutex> guard(lock);
+			tickets.erase(refnum);
+		});
+	
+	return refnum;
+}
+
+TransferServer::Ticket TransferServer::Claim(uint32_t refnum)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	
+	Ticket t;
+	auto it = tickets.find(refnum);
+	if (it == tickets.end()) return t;
+	
+	t = std::move(it->second);
+	tickets.erase(it);
+	return t;
+}
+
+void TransferServer::Listen()
+{
+	auto c = std::make_shared<Connection>(io);
+	
+	listener.async_accept(c->sock,
+		[this, c](boost::system::error_code ec)
+		{
+			if (ec)
+			{
+				if (ec == boost::asio::error::operation_aborted) return;
+				Log(LL_WARNING, "Transfers: "+ec.message());
+			}
+			else
+				boost::asio::dispatch(c->strand, [this, c]() { Start(c); });
+			
+			Listen();
+		});
+}
+
+void TransferServer::Start(std::shared_ptr<Connection> c)
+{
+	using namespace boost::asio;
+	
+	// a connection that never says which transfer it's for doesn't get to hang around
+	c->timer.expires_after(TRANSFER_TTL);
+	c->timer.async_wait(bind_executor(c->strand,
+		[c](boost::system::error_code ec)
+		{
+			if (!ec) c->sock.close(ec);
+		}));
+	
+	async_read(c->sock, buffer(c->hello), bind_executor(c->strand,
+		[this, c](boost::system::error_code ec, size_t)
+		{
+			c->timer.cancel();
+			if (ec) return;
+			
+			if (std::memcmp(c->hello, "HTXF", 4) != 0)
+			{
+				Log(LL_WARNING, "Transfers: Not an HTXF connection");
+				return;
+			}
+			
+			Ticket t = Claim(boost::endian::load_big_u32(c->hello+4));
+			c->download = std::move(t.download);
+			c->upload = std::move(t.upload);
+			c->folder = std::move(t.folder);
+			
+			if (!c->download && !c->upload && !c->folder)
+			{
+				Log(LL_WARNING, "Transfers: No transfer with that reference number");
+				return;
+			}
+			Metrics::Add(MC_ACTIVE_TRANSFERS, 1);
+			
+			if (c->upload) return StartUpload(c);
+			if (c->folder) return StartFolder(c);
+			
+			// hold the headers back until the first of the data can go out with them
+			int on = 1;
+			setsockopt(c->sock.native_handle(), IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+			
+			async_write(c->sock, buffer(c->download->header), bind_executor(c->strand,
+				[this, c](boost::system::error_code ec, size_t n)
+				{
+					if (ec) return;
+					
+					Metrics::Add(MC_TRANSFER_BYTES_OUT, n);
+					c->sock.native_non_blocking(true, ec);
+					if (!ec) SendFile(c, *c->download, [this, c]() { Finish(c); });
+				}));
+		}));
+}
+
+void TransferServer::SendFile(std::shared_ptr<Connection> c, Download &d, Next next)
+{
+	size_t budget = TRANSFER_SLICE;
+	
+	// the kernel moves the data from the page cache to the socket, it never comes up to us
+	while (d.size && budget)
+	{
+		off_t off = d.offset;
+		ssize_t n = sendfile(c->sock.native_handle(), d.fd, &off, std::min<uint64_t>(d.size, budget));
+		
+		if (n > 0)
+		{
+			d.offset += n;
+			d.size -= n;
+			budget -= n;
+			Metrics::Add(MC_TRANSFER_BYTES_OUT, n);
+		}
+		else if (n < 0 && errno == EINTR)
+			continue;
+		else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			c->sock.async_wait(tcp::socket::wait_write, boost::asio::bind_executor(c->strand,
+				[this, c, &d, next](boost::system::error_code ec)
+				{
+					if (!ec) SendFile(c, d, next);
+				}));
+			return;
+		}
+		else
+		{
+			// the client hung up, or the file got shorter under us
+			Log(LL_INFO, std::string("Transfers: Download cut short: ") + (n < 0 ? strerror(errno) : "end of file"));
+			return;
+		}
+	}
+	
+	if (d.size)
+		boost::asio::post(c->strand, [this, c, &d, next]() { SendFile(c, d, next); });
+	else
+		next();
+}
+
+void TransferServer::Finish(std::shared_ptr<Connection> c)
+{
+	int off = 0;
+	setsockopt(c->sock.native_handle(), IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+	
+	// the client closes once it has everything, we just stop sending
+	boost::system::error_code ec;
+	c->sock.shutdown(tcp::socket::shutdown_send, ec);
+}
+
+void TransferServer::StartFolder(std::shared_ptr<Connection> c)
+{
+	boost::system::error_code ec;
+	c->sock.native_non_blocking(true, ec);
+	if (ec) return;
+	
+	// the client starts with a "next" of its own, before there's anything to go on to
+	c->folder->walk.reset(new FolderWalk(c->folder->root));
+	c->folder->replies = 1;
+	Announce(c);
+}
+
+void TransferServer::ReadAhead(FolderDownload &f)
+{
+	FolderWalk::Item item;
+	
+	// open what's coming and have the kernel start reading it in, so the disk works while the
+	// network does and the next file doesn't begin with a stall
+	while (f.ahead.size() < READAHEAD_ITEMS && f.ahead_bytes < READAHEAD_BYTES && f.walk->Next(item))
+	{
+		if (!Sendable(item)) continue;
+		
+		FolderDownload::Item next { item.rel, item.folder, nullptr };
+		if (!item.folder)
+		{
+			int fd = open(JoinPath(f.root, item.rel).c_str(), O_RDONLY | O_CLOEXEC);
+			if (fd < 0) continue;
+			
+			uint64_t size = item.st.st_size;
+			posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+			posix_fadvise(fd, 0, std::min<uint64_t>(size, READAHEAD_BYTES), POSIX_FADV_WILLNEED);
+			
+			auto mtime = std::chrono::system_clock::from_time_t(item.st.st_mtime);
+			std::string_view name(item.rel);
+			name.remove_prefix(name.rfind('/')+1);
+			next.file.reset(new Download(fd, 0, size, FlattenFileHeader(name, mtime, mtime, size)));
+			f.ahead_bytes += size;
+		}
+		
+		f.ahead.push_back(std::move(next));
+	}
+}
+
+void TransferServer::Announce(std::shared_ptr<Connection> c)
+{
+	using boost::endian::store_big_u16;
+	FolderDownload &f = *c->folder;
+	c->reply.clear();
+	f.deciding = false;
+	
+	// what the client says to a folder doesn't change anything, and nor does the "next" it sends
+	// after a file, so there's no waiting on those: headers follow straight on from the data until
+	// there's a file it has to make up its mind about
+	for (unsigned n = 0; n < FOLDER_BATCH && !f.deciding; n++)
+	{
+		ReadAhead(f);
+		if (f.ahead.empty()) break;
+		
+		// a uint16 length, whether it's a folder, then its path within the one being downloaded
+		FolderDownload::Item &item = f.ahead.front();
+		size_t at = c->reply.size();
+		c->reply.resize(at+4);
+		EncodeFilePath(c->reply, item.rel);
+		store_big_u16(c->reply.data()+at, c->reply.size()-at-2);
+		store_big_u16(c->reply.data()+at+2, item.folder);
+		f.replies++;
+		
+		if (item.folder)
+			f.ahead.pop_front();
+		else
+			f.deciding = true;
+	}
+	
+	if (f.ahead.empty() && !f.deciding && c->reply.empty()) return Finish(c);
+	
+	boost::asio::async_write(c->sock, boost::asio::buffer(c->reply), boost::asio::bind_executor(c->strand,
+		[this, c](boost::system::error_code ec, size_t n)
+		{
+			if (ec) return;
+			Metrics::Add(MC_TRANSFER_BYTES_OUT, n);
+			
+			// whatever's held back goes now, the client can't answer what it hasn't seen. Its "next"
+			// no longer gets a header back to carry the ack, and a client that waits on that ack
+			// before sending its decision would otherwise wait out the delayed ack timer, per file.
+			int off = 0, on = 1;
+			setsockopt(c->sock.native_handle(), IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+			setsockopt(c->sock.native_handle(), IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+			Decide(c);
+		}));
+}
+
+void TransferServer::Decide(std::shared_ptr<Connection> c)
+{
+	using namespace boost::asio;
+	using boost::endian::load_big_u16;
+	FolderDownload &f = *c->folder;
+	
+	// all the replies it owes come in one read; only the last can be anything but "next"
+	f.in.resize(2*f.replies);
+	async_read(c->sock, buffer(f.in), bind_executor(c->strand,
+		[this, c](boost::system::error_code ec, size_t n)
+		{
+			FolderDownload &f = *c->folder;
+			if (ec)
+			{
+				Log(LL_INFO, "Transfers: Folder download stopped: " + ec.message());
+				return;
+			}
+			
+			Metrics::Add(MC_TRANSFER_BYTES_IN, n);
+			f.replies = 0;
+			if (!f.deciding) return Announce(c);
+			
+			switch (load_big_u16(f.in.data()+n-2))
+			{
+				case FLDR_SEND:
+					return SendItem(c, 0);
+				case FLDR_RESUME:
+					// a uint16 length, then the same resume data a single file's download gets
+					f.in.resize(2);
+					async_read(c->sock, buffer(f.in), bind_executor(c->strand,
+						[this, c](boost::system::error_code ec, size_t)
+						{
+							FolderDownload &f = *c->folder;
+							if (ec) return;
+							
+							f.in.resize(load_big_u16(f.in.data()));
+							async_read(c->sock, buffer(f.in), bind_executor(c->strand,
+								[this, c](boost::system::error_code ec, size_t n)
+								{
+									FolderDownload &f = *c->folder;
+									uint64_t offset;
+									if (ec) return;
+									
+									Metrics::Add(MC_TRANSFER_BYTES_IN, 2+n);
+									if (!ResumeOffset(ParamView { F_FILERESUMEDATA, uint16_t(n), PK_BYTES, f.in.data() }, offset))
+									{
+										Log(LL_WARNING, "Transfers: Bad resume data in a folder download");
+										return;
+									}
+									SendItem(c, offset);
+								}));
+						}));
+					return;
+				default:
+					// it has this one already
+					f.ahead_bytes -= f.ahead.front().file->size;
+					f.ahead.pop_front();
+					return Announce(c);
+			}
+		}));
+}
+
+void TransferServer::SendItem(std::shared_ptr<Connection> c, uint64_t offset)
+{
+	using namespace boost::asio;
+	FolderDownload &f = *c->folder;
+	Download &d = *f.ahead.front().file;
+	uint64_t size = d.size;
+	
+	// a resume only changes the data fork's size in the headers
+	offset = std::min(offset, d.size);
+	d.offset = offset;
+	d.size -= offset;
+	boost::endian::store_big_u32(d.header.data()+d.header.size()-4, d.size);
+	
+	c->reply.resize(4);
+	boost::endian::store_big_u32(c->reply.data(), d.header.size()+d.size);
+	c->reply.insert(c->reply.end(), d.header.begin(), d.header.end());
+	
+	// from here the headers, the data and the next item's header pack into full segments
+	int on = 1;
+	setsockopt(c->sock.native_handle(), IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+	
+	async_write(c->sock, buffer(c->reply), bind_executor(c->strand,
+		[this, c, &d, size](boost::system::error_code ec, size_t n)
+		{
+			if (ec) return;
+			Metrics::Add(MC_TRANSFER_BYTES_OUT, n);
+			
+			SendFile(c, d,
+				[this, c, size]()
+				{
+					FolderDownload &f = *c->folder;
+					f.ahead_bytes -= size;
+					f.ahead.pop_front();
+					
+					// and the client sends a "next" once it has it all
+					f.replies = 1;
+					Announce(c);
+				});
+		}));
+}
+
+void TransferServer::StartUpload(std::shared_ptr<Connection> c)
+{
+	// aligned, so the page cache copies are as cheap as they get
+	c->buf.reset(static_cast<uint8_t*>(aligned_alloc(UPLOAD_BUFFER_ALIGN, UPLOAD_BUFFER_SIZE)));
+	if (!c->buf) return Abort(*c, "out of memory");
+	
+	if (c->upload->name.empty())
+		Act(c, FLDR_NEXT, 0, [this, c]() { NextItem(c); });
+	else
+		ReceiveFile(c, JoinPath(c->upload->dir, c->upload->name), c->upload->offset, [this, c]() { Finish(c); });
+}
+
+void TransferServer::NextItem(std::shared_ptr<Connection> c)
+{
+	using boost::endian::load_big_u16;
+	
+	if (!c->upload->items) return Finish(c);
+	c->upload->items--;
+	
+	// each item is a uint16 length, then whether it's a folder, then its path within the upload
+	Expect(c, 2,
+		[this, c]()
+		{
+			uint16_t n = load_big_u16(c->buf.get());
+			if (n < 4) return Abort(*c, "malformed folder item");
+			
+			Expect(c, n,
+				[this, c, n]()
+				{
+					bool folder = load_big_u16(c->buf.get()) == 1;
+					std::string rel;
+					if (!DecodeFilePath(ParamView { F_FILEPATH, uint16_t(n-2), PK_BYTES, c->buf.get()+2 }, rel) || rel.empty())
+						return Abort(*c, "bad path in a folder upload");
+					
+					std::string target = JoinPath(c->upload->dir, rel);
+					struct stat st;
+					
+					if (folder)
+					{
+						if (mkdir(target.c_str(), 0755) != 0 && errno != EEXIST) return Abort(*c, strerror(errno));
+						return Act(c, FLDR_NEXT, 0, [this, c]() { NextItem(c); });
+					}
+					
+					// what's already here is skipped, what's partly here is resumed
+					if (stat(target.c_str(), &st) == 0) return Act(c, FLDR_NEXT, 0, [this, c]() { NextItem(c); });
+					uint64_t offset = stat((target+".hpf").c_str(), &st) == 0 ? st.st_size : 0;
+					
+					Act(c, offset ? FLDR_RESUME : FLDR_SEND, offset,
+						[this, c, target, offset]()
+						{
+							// the client says how much is coming, but the fork headers say it too
+							Expect(c, 4,
+								[this, c, target, offset]()
+								{
+									ReceiveFile(c, target, offset,
+										[this, c]() { Act(c, FLDR_NEXT, 0, [this, c]() { NextItem(c); }); });
+								});
+						});
+				});
+		});
+}
+
+void TransferServer::Act(std::shared_ptr<Connection> c, FolderAction action, uint64_t offset, Next next)
+{
+	c->reply.assign(2, 0);
+	boost::endian::store_big_u16(c->reply.data(), action);
+	
+	if (action == FLDR_RESUME)
+	{
+		auto r = ResumeData(offset);
+		c->reply.resize(4);
+		boost::endian::store_big_u16(c->reply.data()+2, r.size());
+		c->reply.insert(c->reply.end(), r.begin(), r.end());
+	}
+	
+	boost::asio::async_write(c->sock, boost::asio::buffer(c->reply), boost::asio::bind_executor(c->strand,
+		[this, c, next](boost::system::error_code ec, size_t)
+		{
+			if (ec) return Abort(*c, ec.message());
+			next();
+		}));
+}
+
+void TransferServer::ReceiveFile(std::shared_ptr<Connection> c, const std::string &target, uint64_t offset, Next next)
+{
+	int fd = open((target+".hpf").c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) return Abort(*c, target + ": " + strerror(errno));
+	
+	// the lock goes with the descriptor, so two uploads of the same file can't interleave
+	struct stat st;
+	if (flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &st) != 0)
+	{
+		close(fd);
+		return Abort(*c, target + " is already being uploaded");
+	}
+	
+	c->target = target;
+	c->file = fd;
+	c->at = std::min<uint64_t>(offset, st.st_size);
+	c->unsynced = 0;
+	c->writing = false;
+	
+	// anything past the resume point is of no use
+	if (ftruncate(c->file, c->at) != 0) return Abort(*c, strerror(errno));
+	
+	Expect(c, FILE_HEADER_SIZE,
+		[this, c, next]()
+		{
+			if (std::memcmp(c->buf.get(), "FILP", 4) != 0) return Abort(*c, "not a flattened file");
+			
+			c->forks = boost::endian::load_big_u16(c->buf.get()+22);
+			ReceiveForks(c, next);
+		});
+}
+
+void TransferServer::ReceiveForks(std::shared_ptr<Connection> c, Next next)
+{
+	if (!c->forks)
+	{
+		if (Complete(*c)) next();
+		return;
+	}
+	c->forks--;
+	
+	Expect(c, FORK_HEADER_SIZE,
+		[this, c, next]()
+		{
+			uint32_t size = boost::endian::load_big_u32(c->buf.get()+12);
+			c->writing = std::memcmp(c->buf.get(), "DATA", 4) == 0;
+			
+			// claim the space in one go, so the file doesn't end up in pieces all over the disk
+			// and a full disk shows up now rather than halfway through
+			if (c->writing && size && fallocate(c->file, FALLOC_FL_KEEP_SIZE, c->at, size) != 0 && errno != EOPNOTSUPP)
+				return Abort(*c, strerror(errno));
+			
+			Stream(c, size, [this, c, next]() { ReceiveForks(c, next); });
+		});
+}
+
+void TransferServer::Expect(std::shared_ptr<Connection> c, size_t n, Next next)
+{
+	boost::asio::async_read(c->sock, boost::asio::buffer(c->buf.get(), n), boost::asio::bind_executor(c->strand,
+		[this, c, n, next](boost::system::error_code ec, size_t)
+		{
+			if (ec) return Abort(*c, ec.message());
+			
+			Metrics::Add(MC_TRANSFER_BYTES_IN, n);
+			next();
+		}));
+}
+
+void TransferServer::Stream(std::shared_ptr<Connection> c, uint64_t n, Next next)
+{
+	if (!n)
+	{
+		int err = WriteOut(*c);
+		if (err) return Abort(*c, strerror(err));
+		return next();
+	}
+	
+	// fill the buffer before writing, so the disk sees a few big writes rather than lots of small ones
+	size_t want = std::min<uint64_t>(n, UPLOAD_BUFFER_SIZE-c->fill);
+	c->sock.async_read_some(boost::asio::buffer(c->buf.get()+c->fill, want), boost::asio::bind_executor(c->strand,
+		[this, c, n, next](boost::system::error_code ec, size_t got)
+		{
+			if (ec) return Abort(*c, ec.message());
+			
+			Metrics::Add(MC_TRANSFER_BYTES_IN, got);
+			c->fill += got;
+			
+			if (c->fill == UPLOAD_BUFFER_SIZE)
+			{
+				int err = WriteOut(*c);
+				if (err) return Abort(*c, strerror(err));
+			}
+			
+			Stream(c, n-got, next);
+		}));
+}
+
+int TransferServer::WriteOut(Connection &c)
+{
+	size_t done = 0;
+	
+	while (c.writing && done < c.fill)
+	{
+		ssize_t n = pwrite(c.file, c.buf.get()+done, c.fill-done, c.at);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) return errno;
+		
+		done += n;
+		c.at += n;
+		c.unsynced += n;
+	}
+	c.fill = 0;
+	
+	if (sync == SYNC_INTERVAL && c.unsynced >= sync_interval)
+	{
+		if (fdatasync(c.file) != 0) return errno;
+		c.unsynced = 0;
+	}
+	
+	return 0;
+}
+
+bool TransferServer::Complete(Connection &c)
+{
+	std::string temp = c.target+".hpf";
+	
+	if (sync != SYNC_NONE && fdatasync(c.file) != 0)
+	{
+		Abort(c, strerror(errno));
+		return false;
+	}
+	
+	close(c.file);
+	c.file = -1;
+	
+	if (rename(temp.c_str(), c.target.c_str()) != 0)
+	{
+		Log(LL_ERROR, "Transfers: Can't rename " + temp + ": " + strerror(errno));
+		return false;
+	}
+	
+	// and the rename itself
+	if (sync != SYNC_NONE)
+	{
+		size_t slash = c.target.rfind('/');
+		int dir = open(slash == std::string::npos ? "." : c.target.substr(0, slash).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (dir >= 0)
+		{
+			fsync(dir);
+			close(dir);
+		}
+	}
+	
+	Log("Transfers: Received " + c.target);
+	return true;
+}
+
+void TransferServer::Abort(Connection &c, const std::string &why)
+{
+	if (c.file < 0)
+	{
+		Log(LL_INFO, "Transfers: Upload stopped: " + why);
+		return;
+	}
+	
+	// keep what did arrive so the client can resume, but not the space set aside for the rest
+	int err = WriteOut(c);
+	if (err || ftruncate(c.file, c.at) != 0)
+		Log(LL_WARNING, "Transfers: Can't tidy up " + c.target + ".hpf: " + strerror(err ? err : errno));
+	Log(LL_INFO, "Transfers: Upload to " + c.target + " stopped at " + std::to_string(c.at) + " bytes: " + why);
+}
+
+TransferServer::Connection::~Connection()
+{
+	if (download || upload || folder) Metrics::Add(MC_ACTIVE_TRANSFERS, -1);
+	if (file >= 0) close(file);
+}
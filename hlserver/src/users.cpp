@@ -1,25 +1,158 @@
+#include <algorithm>
 #include <iomanip>
 #include <sstream>
 
+#include "globals.hpp"
+#include "metrics.hpp"
 #include "users.hpp"
 
 User::User(boost::asio::io_service &io):
+	rx_start(0),
+	rx_end(0),
 	sock(io),
+	strand(io),
+	queued_bytes(0),
+	send_limit(SIZE_MAX),
+	in_flight(0),
+	dropped(0),
 	last_trans_id(0),
-	nreplies(0)
+	nreplies(0),
+	capture_id(0),
+	logged_in(false),
+	verifying(false),
+	close_when_flushed(false)
 {
+	flags[UF_VISIBLE] = true;
 }
 
 User::~User()
 {
 	if (sock.is_open()) Disconnect();
+	if (queued_bytes) Metrics::Add(MC_QUEUED_BYTES, -static_cast<int64_t>(queued_bytes));
 }
 
 void User::Disconnect()
 {
 	// NOTE: should we care about socket errors here?
-	sock.cancel();
-	sock.close();
+	boost::system::error_code ec;
+	sock.cancel(ec);
+	sock.close(ec);
+}
+
+void User::CloseWhenFlushed()
+{
+	boost::asio::dispatch(strand,
+		[self = shared_from_this()]()
+		{
+			// the pending read fails once the socket is shut down and takes the usual disconnect path
+			if (self->outbox.empty())
+			{
+				boost::system::error_code ec;
+				self->sock.shutdown(tcp::socket::shutdown_both, ec);
+			}
+			else
+				self->close_when_flushed = true;
+		});
+}
+
+void User::Send(const Frame &frame, SendPriority prio, bool stamp)
+{
+	// anyone may send to us, but the outbox is only ever touched on our strand
+	boost::asio::dispatch(strand,
+		[self = shared_from_this(), frame, prio, stamp]()
+		{
+			self->Enqueue(frame, prio, stamp);
+		});
+}
+
+void User::Enqueue(Frame frame, SendPriority prio, bool stamp)
+{
+	if (!sock.is_open()) return;
+	if (stamp) frame.SetID(++last_trans_id);
+	
+	if (queued_bytes+frame.Size() > send_limit)
+	{
+		if (prio == SP_LOW)
+		{
+			++dropped;
+			Metrics::Add(MC_DROPPED_FRAMES, 1);
+			return;
+		}
+		
+		// make room by shedding whatever low priority traffic isn't already being written
+		auto keep = std::remove_if(outbox.begin()+in_flight, outbox.end(),
+			[this](const std::pair<Frame, SendPriority> &o)
+			{
+				if (o.second != SP_LOW) return false;
+				queued_bytes -= o.first.Size();
+				Metrics::Add(MC_QUEUED_BYTES, -static_cast<int64_t>(o.first.Size()));
+				Metrics::Add(MC_DROPPED_FRAMES, 1);
+				++dropped;
+				return true;
+			});
+		outbox.erase(keep, outbox.end());
+		
+		if (queued_bytes+frame.Size() > send_limit)
+		{
+			Log(LL_WARNING, "["+host+"]: Send queue overflow, disconnecting");
+			for (auto it = outbox.begin()+in_flight; it != outbox.end(); ++it)
+			{
+				queued_bytes -= it->first.Size();
+				Metrics::Add(MC_QUEUED_BYTES, -static_cast<int64_t>(it->first.Size()));
+			}
+			outbox.erase(outbox.begin()+in_flight, outbox.end());
+			
+			// the pending read fails and takes the usual disconnect path
+			boost::system::error_code ec;
+			sock.shutdown(tcp::socket::shutdown_both, ec);
+			return;
+		}
+	}
+	
+	outbox.emplace_back(frame, prio);
+	queued_bytes += frame.Size();
+	Metrics::Add(MC_QUEUED_BYTES, frame.Size());
+	if (!in_flight) Flush();
+}
+
+void User::Flush()
+{
+	gather.clear();
+	in_flight = std::min<size_t>(outbox.size(), MAX_GATHER);
+	
+	for (size_t i = 0; i < in_flight; i++)
+	{
+		auto b = outbox[i].first.Buffers();
+		gather.push_back(b[0]);
+		if (b[1].size()) gather.push_back(b[1]);
+	}
+	
+	boost::asio::async_write(sock, gather, boost::asio::bind_executor(strand,
+		[this, self = shared_from_this()](boost::system::error_code ec, size_t s)
+		{
+			Metrics::Add(MC_BYTES_OUT, s);
+			
+			while (in_flight)
+			{
+				queued_bytes -= outbox.front().first.Size();
+				Metrics::Add(MC_QUEUED_BYTES, -static_cast<int64_t>(outbox.front().first.Size()));
+				outbox.pop_front();
+				--in_flight;
+			}
+			
+			if (ec)
+			{
+				// the read side notices a dead connection and cleans up
+				if (ec != boost::asio::error::operation_aborted) Log(LL_WARNING, "["+host+"]: "+ec.message());
+				outbox.clear();
+				Metrics::Add(MC_QUEUED_BYTES, -static_cast<int64_t>(queued_bytes));
+				queued_bytes = 0;
+			}
+			else if (!outbox.empty())
+				Flush();
+			else if (close_when_flushed)
+				sock.shutdown(tcp::socket::shutdown_both, ec);
+		}));
 }
 
 std::string User::InfoText() const
@@ -29,8 +162,8 @@ std::string User::InfoText() const
 	ss << std::setw(22) << std::left << "Name: " << std::setw(32) << std::left << name << '\r' <<
 		std::setw(22) << std::left << "Login: " << std::setw(32) << std::left  << login << '\r' <<
 		std::setw(22) << std::left << "Password Hash: " << std::setw(32) << std::left  << PasswordSumString() << '\r' <<
-		std::setw(22) << std::left << "Address: " << std::setw(32) << std::left  << sock.remote_endpoint().address().to_string() << '\r' <<
-		std::setw(22) << std::left << "Port: " << std::setw(32) << std::left  << sock.remote_endpoint().port() << '\r' <<
+		std::setw(22) << std::left << "Address: " << std::setw(32) << std::left  << remote.address().to_string() << '\r' <<
+		std::setw(22) << std::left << "Port: " << std::setw(32) << std::left  << remote.port() << '\r' <<
 		std::setw(22) << std::left << "Hostname: " << std::setw(32) << std::left  << host << '\r' <<
 		std::setw(22) << std::left << "User ID: " << std::setw(32) << std::left  << id << '\r' <<
 		std::setw(22) << std::left << "Version: " << std::setw(32) << std::left  << VersionString() << '\r' <<
@@ -40,3 +173,148 @@ std::string User::InfoText() const
 	
 	return ss.str();
 }
+
+UserTable::UserTable():
+	slots(UINT16_MAX+1),
+	where(UINT16_MAX+1),
+	live(std::make_shared<const Snapshot>()),
+	stale(false),
+	next_id(1)
+{
+}
+
+uint16_t UserTable::Add(UserPtr u)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	uint16_t id;
+	
+	// hand out fresh IDs before recycling, so a departed user's ID lingers as long as possible
+	if (next_id <= UINT16_MAX)
+		id = next_id++;
+	else if (!free_ids.empty())
+	{
+		id = free_ids.front();
+		free_ids.pop_front();
+	}
+	else
+		return 0; // full house
+	
+	u->id = id;
+	std::atomic_store(&slots[id], u);
+	
+	where[id] = members.size();
+	members.push_back(u);
+	stale.store(true, std::memory_order_release);
+	
+	return id;
+}
+
+bool UserTable::Remove(const UserPtr &u)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	uint16_t id = u->id;
+	
+	if (!id || slots[id] != u) return false;
+	
+	std::atomic_store(&slots[id], UserPtr());
+	free_ids.push_back(id);
+	
+	// the last one fills the gap
+	uint16_t at = where[id];
+	members[at] = std::move(members.back());
+	where[members[at]->id] = at;
+	members.pop_back();
+	stale.store(true, std::memory_order_release);
+	
+	return true;
+}
+
+std::shared_ptr<const UserTable::Snapshot> UserTable::Live()
+{
+	if (!stale.load(std::memory_order_acquire)) return std::atomic_load(&live);
+	
+	std::lock_guard<std::mutex> guard(lock);
+	if (stale.load(std::memory_order_relaxed))
+	{
+		std::atomic_store(&live, std::shared_ptr<const Snapshot>(std::make_shared<Snapshot>(members)));
+		stale.store(false, std::memory_order_release);
+	}
+	return live;
+}
+
+size_t UserTable::Count()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return members.size();
+}
+
+void UserListCache::Variant::Patch(uint16_t id, const uint8_t *rec, size_t len)
+{
+	using namespace boost::endian;
+	
+	size_t at = 0;
+	
+	// records are tiny, hopping over them beats keeping an index in sync
+	while (at < fields.size() && load_big_u16(&fields[at+4]) != id)
+		at += load_big_u16(&fields[at+2])+4;
+	
+	if (at < fields.size())
+	{
+		size_t old = load_big_u16(&fields[at+2])+4;
+		
+		if (rec && len == old)
+			std::copy(rec, rec+len, &fields[at]);
+		else
+		{
+			fields.erase(fields.begin()+at, fields.begin()+at+old);
+			if (rec)
+				fields.insert(fields.begin()+at, rec, rec+len);
+			else
+				--count;
+		}
+	}
+	else if (rec)
+	{
+		fields.insert(fields.end(), rec, rec+len);
+		++count;
+	}
+	else
+		return;
+	
+	dirty = true;
+}
+
+void UserListCache::Update(const User *u)
+{
+	boost::container::small_vector<uint8_t, 64> rec(UserInfoSize(u)+4);
+	
+	boost::endian::store_big_u16(&rec[0], F_USERNAMEWITHINFO);
+	boost::endian::store_big_u16(&rec[2], rec.size()-4);
+	EncodeUserInfo(u, &rec[4]);
+	
+	std::lock_guard<std::mutex> guard(lock);
+	everyone.Patch(u->id, rec.data(), rec.size());
+	visible.Patch(u->id, u->flags[UF_VISIBLE] ? rec.data() : nullptr, rec.size());
+}
+
+void UserListCache::Remove(uint16_t id)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	everyone.Patch(id, nullptr, 0);
+	visible.Patch(id, nullptr, 0);
+}
+
+UserListCache::Listing UserListCache::List(bool with_hidden)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	Variant &v = with_hidden ? everyone : visible;
+	
+	// frames already queued hold on to the old copy, so publish a new one rather than touching it
+	if (v.dirty)
+	{
+		v.published = Listing { std::make_shared<const std::vector<uint8_t>>(v.fields), v.count };
+		v.dirty = false;
+	}
+	
+	return v.published;
+}